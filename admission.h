@@ -0,0 +1,184 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+   Admission control for the server.
+
+   There is one AdmissionControl per worker, and a worker is single threaded,
+   so nothing in here is locked. Every new session (a TCP accept or a UDP hello)
+   has to pass admit() BEFORE any session state is allocated for it, and must
+   call release() with the same key when the session is torn down.
+
+   Three limits are applied, in this order:
+     - maxSessions, concurrent sessions on the worker (TCP and UDP together)
+     - maxPerIp,    concurrent sessions from one source address on the worker
+     - rate/burst,  a token bucket on the number of new sessions per second
+
+   A value of 0 disables the corresponding limit.
+*/
+
+// Source address of a peer, IPv4 addresses are stored as v4-mapped IPv6.
+struct IpKey {
+  uint64_t hi;
+  uint64_t lo;
+
+  bool operator==(const IpKey &o) const { return hi == o.hi && lo == o.lo; }
+};
+
+struct IpKeyHash {
+  size_t operator()(const IpKey &k) const {
+    return (size_t)(k.hi * 0x9e3779b97f4a7c15ULL ^ k.lo);
+  }
+};
+
+static inline IpKey ipKeyFromSockaddr(const struct sockaddr *sa) {
+  unsigned char b[16];
+  memset(b, 0, sizeof(b));
+  if (sa->sa_family == AF_INET6) {
+    memcpy(b, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+  } else if (sa->sa_family == AF_INET) {
+    b[10] = 0xff;
+    b[11] = 0xff;
+    memcpy(b + 12, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+  }
+  IpKey k;
+  memcpy(&k.hi, b, 8);
+  memcpy(&k.lo, b + 8, 8);
+  return k;
+}
+
+/* Text form of a key, IPv4 addresses without the v4-mapped prefix. */
+static inline void ipKeyFormat(const IpKey &k, char *out, socklen_t len) {
+  static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+  unsigned char b[16];
+  memcpy(b, &k.hi, 8);
+  memcpy(b + 8, &k.lo, 8);
+  if (memcmp(b, mapped, sizeof(mapped)) == 0) {
+    inet_ntop(AF_INET, b + 12, out, len);
+  } else {
+    inet_ntop(AF_INET6, b, out, len);
+  }
+}
+
+/*
+   Classic token bucket. Tokens are refilled lazily from the timestamp passed
+   to take(), so the caller decides which clock to use (monotonic ns).
+*/
+class TokenBucket {
+public:
+  TokenBucket() : rate(0), burst(0), tokens(0), lastNs(0) {}
+
+  void configure(double perSecond, double depth) {
+    rate = perSecond;
+    burst = depth > 0 ? depth : (perSecond > 1 ? perSecond : 1);
+    tokens = burst;
+    lastNs = 0;
+  }
+
+  bool take(uint64_t nowNs) {
+    if (rate <= 0) {
+      return true;
+    }
+    if (lastNs != 0 && nowNs > lastNs) {
+      tokens += (double)(nowNs - lastNs) * rate / 1e9;
+      if (tokens > burst) {
+        tokens = burst;
+      }
+    }
+    lastNs = nowNs;
+    if (tokens < 1.0) {
+      return false;
+    }
+    tokens -= 1.0;
+    return true;
+  }
+
+private:
+  double rate;
+  double burst;
+  double tokens;
+  uint64_t lastNs;
+};
+
+enum AdmitResult { ADMIT_OK, ADMIT_FULL, ADMIT_PER_IP, ADMIT_RATE };
+
+struct AdmissionStats {
+  uint64_t admitted;
+  uint64_t rejectedFull;
+  uint64_t rejectedPerIp;
+  uint64_t rejectedRate;
+};
+
+class AdmissionControl {
+public:
+  AdmissionControl() : maxSessions(0), maxPerIp(0), active(0) {
+    memset(&stats, 0, sizeof(stats));
+  }
+
+  void configure(int sessions, int perIp, double rate, double burst) {
+    maxSessions = sessions;
+    maxPerIp = perIp;
+    bucket.configure(rate, burst);
+  }
+
+  /* Decide if a new session from <ip> may start. On ADMIT_OK the session is
+     counted and the caller owns a matching release(). */
+  AdmitResult admit(const IpKey &ip, uint64_t nowNs) {
+    if (maxSessions > 0 && active >= maxSessions) {
+      stats.rejectedFull++;
+      return ADMIT_FULL;
+    }
+    if (maxPerIp > 0) {
+      std::unordered_map<IpKey, int, IpKeyHash>::iterator it = perIp.find(ip);
+      if (it != perIp.end() && it->second >= maxPerIp) {
+        stats.rejectedPerIp++;
+        return ADMIT_PER_IP;
+      }
+    }
+    if (!bucket.take(nowNs)) {
+      stats.rejectedRate++;
+      return ADMIT_RATE;
+    }
+    active++;
+    if (maxPerIp > 0) {
+      perIp[ip]++;
+    }
+    stats.admitted++;
+    return ADMIT_OK;
+  }
+
+  /* Count a session that was admitted by a previous server process (hot
+     restart). It is never rejected, but it does count against the limits. */
+  void admitExisting(const IpKey &ip) {
+    active++;
+    if (maxPerIp > 0) {
+      perIp[ip]++;
+    }
+  }
+
+  void release(const IpKey &ip) {
+    active--;
+    if (maxPerIp > 0) {
+      std::unordered_map<IpKey, int, IpKeyHash>::iterator it = perIp.find(ip);
+      if (it != perIp.end() && --it->second <= 0) {
+        perIp.erase(it);
+      }
+    }
+  }
+
+  int activeSessions() const { return active; }
+
+  AdmissionStats stats;
+
+private:
+  int maxSessions;
+  int maxPerIp;
+  int active;
+  TokenBucket bucket;
+  std::unordered_map<IpKey, int, IpKeyHash> perIp;
+};
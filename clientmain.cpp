@@ -7,62 +7,203 @@
 #include <system_error>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <cerrno>
 #include <sstream>
 #include <regex>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <map>
+#include "protocol.h"
+#include "codec.h"
+#include "trace.h"
+#include "shmtransport.h"
+#include "loadgen.h"
 
 // Protocol and API type enums
-enum class Protocol { TCP, UDP, ANY };
+enum class Protocol { TCP, UDP, ANY, SHM };
 enum class ApiType { TEXT, BINARY };
 
-// Binary protocol constants
-const uint16_t CALC_MESSAGE_TYPE = 22;
-const uint16_t CALC_PROTOCOL_TYPE = 1;
-const uint16_t ERROR_MESSAGE_TYPE = 2;
+// Binary protocol constants, message layouts are in protocol.h
+const uint16_t CALC_MESSAGE_TYPE = 22;  // calcMessage, client-to-server, binary
+const uint16_t CALC_PROTOCOL_TYPE = 1;  // calcProtocol, server-to-client
+const uint16_t CALC_ANSWER_TYPE = 2;    // calcProtocol, client-to-server
+const uint16_t SERVER_MESSAGE_TYPE = 2; // calcMessage, server-to-client, binary
 const uint16_t PROTOCOL_ID = 17;
 const uint16_t MAJOR_VERSION = 1;
 const uint16_t MINOR_VERSION = 0;
 
-// Binary message structures
-#pragma pack(push, 1)
-struct CalcMessage {
-    uint16_t type;
-    uint16_t message;
-    uint16_t protocol;
-    uint16_t major_version;
-    uint16_t minor_version;
+// Shared-memory transport: spin this long for a reply before sleeping, but
+// never on a single CPU, where spinning only keeps the server from running
+const int SHM_SPIN_US = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 50 : 0;
+const int SHM_TIMEOUT_MS = 2000;
+
+// Segment counts of the TCP sessions, collected by the benchmark from TCP_INFO
+struct TcpSegments {
+    bool enabled = false;
+    long sessions = 0;
+    uint64_t in = 0;      // Segments from the server, ACKs and FIN included
+    uint64_t dataIn = 0;  // Of those, segments that carried data
+    uint64_t out = 0;
 };
+static TcpSegments tcpSegments;
+
+// What each TCP server offered, with its resume ticket (codec.h), by numeric
+// "address:port". Sessions after the first to a server skip the protocol
+// list; with --caps-cache the entries outlive the process
+struct CapsCache {
+    bool enabled = true;
+    std::string path;
+    std::map<std::string, ProtocolCaps> entries;
 
-struct CalcProtocol {
-    uint16_t type;
-    uint16_t major_version;
-    uint16_t minor_version;
-    uint32_t id;
-    uint32_t arith;
-    int32_t in_value1;
-    int32_t in_value2;
-    int32_t in_result;  // Only used in response
+    void load() {
+        std::ifstream file(path);
+        std::string endpoint;
+        ProtocolCaps caps;
+        while (file >> endpoint >> std::hex >> caps.caps >> caps.ticket) {
+            entries[endpoint] = caps;
+        }
+    }
+    bool save() const {
+        std::string tmp = path + ".tmp";
+        std::ofstream file(tmp, std::ios::trunc);
+        for (const auto& e : entries) {
+            file << e.first << " " << std::hex << e.second.caps << " " << e.second.ticket << std::dec << "\n";
+        }
+        file.close();
+        return file && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
+static CapsCache capsCache;
+
+// Reads of one TCP session through a buffer, so bytes the server sent
+// together (an ACK and the assignment) are not split over wrong reads
+class TcpReader {
+public:
+    explicit TcpReader(int fd) : sockfd(fd) {}
+
+    // The next byte, left unread
+    int peek() {
+        fill(1);
+        return (unsigned char)buffer[0];
+    }
+    void skip(size_t n) {
+        buffer.erase(0, n);
+    }
+    // Up to "\n", without it
+    std::string line() {
+        size_t pos;
+        while ((pos = buffer.find('\n')) == std::string::npos) {
+            fill(buffer.size() + 1);
+        }
+        std::string l = buffer.substr(0, pos);
+        buffer.erase(0, pos + 1);
+        return l;
+    }
+    void exact(void* data, size_t len) {
+        fill(len);
+        buffer.copy((char*)data, len);
+        buffer.erase(0, len);
+    }
+
+private:
+    void fill(size_t want) {
+        char chunk[1024];
+        while (buffer.size() < want) {
+            ssize_t bytesRead = recv(sockfd, chunk, sizeof(chunk), 0);
+            if (bytesRead <= 0) {
+                throw std::runtime_error("Connection closed by server");
+            }
+            buffer.append(chunk, bytesRead);
+        }
+    }
+
+    int sockfd;
+    std::string buffer;
 };
-#pragma pack(pop)
 
 // Function prototypes
 void parseURL(const std::string& url, Protocol& protocol, std::string& host, int& port, ApiType& apiType);
 addrinfo* resolveHost(const std::string& host, int port, Protocol protocol);
-bool handleTCPText(int sockfd);
-bool handleTCPBinary(int sockfd);
+bool runSession(Protocol protocol, ApiType apiType, const addrinfo* tcpAddrInfo, const addrinfo* udpAddrInfo);
+bool runTCP(const addrinfo* addrInfo, ApiType apiType);
+bool runUDP(const addrinfo* addrInfo, ApiType apiType);
+bool runSHM(ShmEndpoint* endpoint, ApiType apiType);
+bool runBenchmark(long sessions, const std::function<bool()>& session);
+bool runLoad(LoadConfig config, Protocol protocol, ApiType apiType, const addrinfo* tcpAddrInfo, const addrinfo* udpAddrInfo, const std::string& outPrefix);
+bool solve(const Operator* op, const std::string& opName, int32_t value1, int32_t value2, int32_t& result);
+bool negotiateTCP(int sockfd, TcpReader& in, const std::string& endpoint, ApiType apiType, uint32_t traceId);
+bool handleTCPText(int sockfd, const std::string& endpoint);
+bool handleTCPBinary(int sockfd, const std::string& endpoint);
 bool handleUDPText(int sockfd, const struct sockaddr_in& server_addr);
 bool handleUDPBinary(int sockfd, const struct sockaddr_in& server_addr);
+bool handleSHMText(ShmEndpoint* endpoint);
+bool handleSHMBinary(ShmEndpoint* endpoint);
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " PROTOCOL://host:port/api" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " PROTOCOL://host:port/api [--trace FILE] [--trace-sample N] [--bench N]" << std::endl;
+        std::cerr << "       " << argv[0] << " PROTOCOL://host:port/api [--caps-cache FILE] [--no-resume] ..." << std::endl;
+        std::cerr << "       " << argv[0] << " PROTOCOL://host:port/api --rate R[/s] [--threads N] [--inflight N] [--duration S] [--out PREFIX]" << std::endl;
         std::cerr << "Example: " << argv[0] << " TCP://alice.nplab.bth.se:5000/text" << std::endl;
+        std::cerr << "         " << argv[0] << " SHM://name/binary (server started with --shm name)" << std::endl;
         return 1;
     }
 
+    // Optional tracing of the session phases, see trace.h
+    const char* tracePath = nullptr;
+    unsigned traceSample = 1;
+    // Optional latency benchmark, run N sessions back to back
+    long benchSessions = 0;
+    // Optional open-loop load test, see loadgen.h
+    LoadConfig load;
+    memset(&load, 0, sizeof(load));
+    load.threads = 1;
+    load.maxInFlight = 64;
+    load.duration = 10;
+    load.timeoutMs = 2000;
+    load.pin = true;
+    std::string outPrefix;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            traceSample = std::stoul(argv[++i]);
+        } else if (arg == "--bench" && i + 1 < argc) {
+            benchSessions = std::stol(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            load.rate = std::stod(argv[++i]); // "R" or "R/s"
+        } else if (arg == "--threads" && i + 1 < argc) {
+            load.threads = std::stoi(argv[++i]);
+        } else if (arg == "--inflight" && i + 1 < argc) {
+            load.maxInFlight = std::stoi(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            load.duration = std::stod(argv[++i]);
+        } else if (arg == "--out" && i + 1 < argc) {
+            outPrefix = argv[++i];
+        } else if (arg == "--caps-cache" && i + 1 < argc) {
+            capsCache.path = argv[++i];
+        } else if (arg == "--no-resume") {
+            capsCache.enabled = false; // Always the protocol list, as a legacy client
+            load.legacyHandshake = true;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (tracePath) {
+        traceConfigure(traceSample, 1 << 12);
+    }
+    if (!capsCache.path.empty()) {
+        capsCache.load();
+    }
+
     Protocol protocol;
     std::string host;
     int port;
@@ -75,6 +216,7 @@ int main(int argc, char* argv[]) {
             case Protocol::TCP: std::cout << "TCP"; break;
             case Protocol::UDP: std::cout << "UDP"; break;
             case Protocol::ANY: std::cout << "ANY"; break;
+            case Protocol::SHM: std::cout << "SHM"; break;
         }
         std::cout << ", Host: " << host << ", Port: " << port << ", API: ";
         switch (apiType) {
@@ -83,81 +225,54 @@ int main(int argc, char* argv[]) {
         }
         std::cout << std::endl;
 
-        bool success = false;
+        // Resolve once, the benchmark reuses the addresses for every session
+        addrinfo* tcpAddrInfo = nullptr;
+        addrinfo* udpAddrInfo = nullptr;
+        if (protocol == Protocol::TCP || protocol == Protocol::ANY) {
+            tcpAddrInfo = resolveHost(host, port, Protocol::TCP);
+        }
+        if (protocol == Protocol::UDP || protocol == Protocol::ANY) {
+            udpAddrInfo = resolveHost(host, port, Protocol::UDP);
+        }
 
-        if (protocol == Protocol::ANY) {
-            // Try TCP first
-            addrinfo* tcpAddrInfo = resolveHost(host, port, Protocol::TCP);
-            int tcpSockfd = socket(tcpAddrInfo->ai_family, tcpAddrInfo->ai_socktype, tcpAddrInfo->ai_protocol);
-            
-            if (tcpSockfd >= 0) {
-                if (connect(tcpSockfd, tcpAddrInfo->ai_addr, tcpAddrInfo->ai_addrlen) >= 0) {
-                    if (apiType == ApiType::TEXT) {
-                        success = handleTCPText(tcpSockfd);
-                    } else {
-                        success = handleTCPBinary(tcpSockfd);
-                    }
-                }
-                close(tcpSockfd);
-            }
-            
-            freeaddrinfo(tcpAddrInfo);
-
-            // If TCP failed, try UDP
-            if (!success) {
-                std::cout << "TCP failed, trying UDP..." << std::endl;
-                addrinfo* udpAddrInfo = resolveHost(host, port, Protocol::UDP);
-                int udpSockfd = socket(udpAddrInfo->ai_family, udpAddrInfo->ai_socktype, udpAddrInfo->ai_protocol);
-                
-                if (udpSockfd >= 0) {
-                    struct sockaddr_in server_addr;
-                    memset(&server_addr, 0, sizeof(server_addr));
-                    server_addr = *(struct sockaddr_in*)udpAddrInfo->ai_addr;
-                    
-                    if (apiType == ApiType::TEXT) {
-                        success = handleUDPText(udpSockfd, server_addr);
-                    } else {
-                        success = handleUDPBinary(udpSockfd, server_addr);
-                    }
-                    close(udpSockfd);
-                }
-                
-                freeaddrinfo(udpAddrInfo);
+        // Shared memory: one channel, the benchmark runs all its sessions over it
+        ShmEndpoint shmEndpoint;
+        int shmControlFd = -1;
+        if (protocol == Protocol::SHM) {
+            shmControlFd = shmConnect(host.c_str(), &shmEndpoint);
+            if (shmControlFd < 0) {
+                throw std::runtime_error("No shared-memory server named " + host);
             }
-        } else if (protocol == Protocol::TCP) {
-            addrinfo* addrInfo = resolveHost(host, port, Protocol::TCP);
-            int sockfd = socket(addrInfo->ai_family, addrInfo->ai_socktype, addrInfo->ai_protocol);
-            
-            if (sockfd >= 0) {
-                if (connect(sockfd, addrInfo->ai_addr, addrInfo->ai_addrlen) >= 0) {
-                    if (apiType == ApiType::TEXT) {
-                        success = handleTCPText(sockfd);
-                    } else {
-                        success = handleTCPBinary(sockfd);
-                    }
-                }
-                close(sockfd);
-            }
-            
-            freeaddrinfo(addrInfo);
-        } else { // UDP
-            addrinfo* addrInfo = resolveHost(host, port, Protocol::UDP);
-            int sockfd = socket(addrInfo->ai_family, addrInfo->ai_socktype, addrInfo->ai_protocol);
-            
-            if (sockfd >= 0) {
-                struct sockaddr_in server_addr;
-                memset(&server_addr, 0, sizeof(server_addr));
-                server_addr = *(struct sockaddr_in*)addrInfo->ai_addr;
-                
-                if (apiType == ApiType::TEXT) {
-                    success = handleUDPText(sockfd, server_addr);
-                } else {
-                    success = handleUDPBinary(sockfd, server_addr);
-                }
-                close(sockfd);
+        }
+
+        std::function<bool()> session = [&]() {
+            if (protocol == Protocol::SHM) {
+                return runSHM(&shmEndpoint, apiType);
             }
-            
-            freeaddrinfo(addrInfo);
+            return runSession(protocol, apiType, tcpAddrInfo, udpAddrInfo);
+        };
+        bool success;
+        if (load.rate > 0) {
+            success = runLoad(load, protocol, apiType, tcpAddrInfo, udpAddrInfo, outPrefix);
+        } else if (benchSessions > 0) {
+            success = runBenchmark(benchSessions, session);
+        } else {
+            success = session();
+        }
+
+        if (tcpAddrInfo) freeaddrinfo(tcpAddrInfo);
+        if (udpAddrInfo) freeaddrinfo(udpAddrInfo);
+        if (shmControlFd >= 0) {
+            shmClose(&shmEndpoint);
+            close(shmControlFd);
+        }
+
+        if (!capsCache.path.empty() && !capsCache.save()) {
+            std::cerr << "ERROR: Could not write " << capsCache.path << std::endl;
+        }
+
+        if (tracePath && !traceDump(tracePath)) {
+            std::cerr << "ERROR: Could not write trace to " << tracePath << std::endl;
         }
 
         return success ? 0 : 1;
@@ -168,7 +283,8 @@ int main(int argc, char* argv[]) {
 }
 
 void parseURL(const std::string& url, Protocol& protocol, std::string& host, int& port, ApiType& apiType) {
-    std::regex urlRegex("([a-zA-Z]+)://([^:/]+):(\\d+)/([a-zA-Z]+)");
+    // The port is optional in the pattern, only SHM (where host is the server name) goes without
+    std::regex urlRegex("([a-zA-Z]+)://([^:/]+)(?::(\\d+))?/([a-zA-Z]+)");
     std::smatch matches;
     
     if (!std::regex_match(url, matches, urlRegex)) {
@@ -177,7 +293,7 @@ void parseURL(const std::string& url, Protocol& protocol, std::string& host, int
     
     std::string protocolStr = matches[1];
     host = matches[2];
-    port = std::stoi(matches[3]);
+    port = matches[3].matched ? std::stoi(matches[3]) : 0;
     std::string apiStr = matches[4];
     
     // Convert protocol string to enum
@@ -187,9 +303,14 @@ void parseURL(const std::string& url, Protocol& protocol, std::string& host, int
         protocol = Protocol::UDP;
     } else if (protocolStr == "ANY" || protocolStr == "any") {
         protocol = Protocol::ANY;
+    } else if (protocolStr == "SHM" || protocolStr == "shm") {
+        protocol = Protocol::SHM;
     } else {
         throw std::runtime_error("Invalid protocol: " + protocolStr);
     }
+    if ((protocol == Protocol::SHM) == matches[3].matched) {
+        throw std::runtime_error(protocol == Protocol::SHM ? "SHM takes no port" : "Missing port");
+    }
     
     // Convert API string to enum
     if (apiStr == "text" || apiStr == "TEXT") {
@@ -221,107 +342,304 @@ addrinfo* resolveHost(const std::string& host, int port, Protocol protocol) {
     return result;
 }
 
-bool handleTCPText(int sockfd) {
-    try {
-        // Read server protocols
-        std::vector<std::string> protocols;
-        char buffer[1024];
-        std::string data;
-        
-        while (true) {
-            ssize_t bytesRead = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-            if (bytesRead <= 0) {
-                throw std::runtime_error("Connection closed by server");
-            }
-            
-            buffer[bytesRead] = '\0';
-            data += buffer;
-            
-            size_t pos = data.find('\n');
-            if (pos != std::string::npos) {
-                std::istringstream iss(data.substr(0, pos));
-                std::string line;
-                while (std::getline(iss, line)) {
-                    if (line.empty()) break;
-                    protocols.push_back(line);
-                }
-                break;
+bool runSession(Protocol protocol, ApiType apiType, const addrinfo* tcpAddrInfo, const addrinfo* udpAddrInfo) {
+    if (protocol == Protocol::TCP) {
+        return runTCP(tcpAddrInfo, apiType);
+    }
+    if (protocol == Protocol::UDP) {
+        return runUDP(udpAddrInfo, apiType);
+    }
+
+    // ANY: try TCP first, if TCP failed, try UDP
+    if (runTCP(tcpAddrInfo, apiType)) {
+        return true;
+    }
+    std::cout << "TCP failed, trying UDP..." << std::endl;
+    return runUDP(udpAddrInfo, apiType);
+}
+
+bool runTCP(const addrinfo* addrInfo, ApiType apiType) {
+    bool success = false;
+    int sockfd = socket(addrInfo->ai_family, addrInfo->ai_socktype, addrInfo->ai_protocol);
+    
+    if (sockfd >= 0) {
+        // Every message is a whole round trip, Nagle could only delay it
+        int one = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        std::string endpoint;
+        if (getnameinfo(addrInfo->ai_addr, addrInfo->ai_addrlen, host, sizeof(host), port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            endpoint = std::string(host) + ":" + port;
+        }
+        if (connect(sockfd, addrInfo->ai_addr, addrInfo->ai_addrlen) >= 0) {
+            if (apiType == ApiType::TEXT) {
+                success = handleTCPText(sockfd, endpoint);
+            } else {
+                success = handleTCPBinary(sockfd, endpoint);
             }
         }
-        
-        // Check if TEXT TCP 1.1 is supported
-        bool textTcp11Supported = false;
-        for (const auto& p : protocols) {
-            if (p == "TEXT TCP 1.1") {
-                textTcp11Supported = true;
-                break;
+        if (success && tcpSegments.enabled) {
+            // Count up to the server's FIN, wherever it came
+            char rest[64];
+            while (recv(sockfd, rest, sizeof(rest), 0) > 0) {
+            }
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+                len >= offsetof(struct tcp_info, tcpi_data_segs_out)) {
+                tcpSegments.sessions++;
+                tcpSegments.in += info.tcpi_segs_in;
+                tcpSegments.dataIn += info.tcpi_data_segs_in;
+                tcpSegments.out += info.tcpi_segs_out;
             }
         }
+        close(sockfd);
+    }
+    return success;
+}
+
+bool runUDP(const addrinfo* addrInfo, ApiType apiType) {
+    bool success = false;
+    int sockfd = socket(addrInfo->ai_family, addrInfo->ai_socktype, addrInfo->ai_protocol);
+    
+    if (sockfd >= 0) {
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr = *(struct sockaddr_in*)addrInfo->ai_addr;
         
-        if (!textTcp11Supported) {
-            std::cerr << "ERROR: MISSMATCH PROTOCOL" << std::endl;
+        if (apiType == ApiType::TEXT) {
+            success = handleUDPText(sockfd, server_addr);
+        } else {
+            success = handleUDPBinary(sockfd, server_addr);
+        }
+        close(sockfd);
+    }
+    return success;
+}
+
+// One session over an open shared-memory channel
+bool runSHM(ShmEndpoint* endpoint, ApiType apiType) {
+    if (apiType == ApiType::TEXT) {
+        return handleSHMText(endpoint);
+    }
+    return handleSHMBinary(endpoint);
+}
+
+// Run <sessions> sessions one after the other and report the latency
+// distribution of a whole session, e.g. to compare server modes on loopback.
+bool runBenchmark(long sessions, const std::function<bool()>& session) {
+    std::vector<double> latencies;
+    latencies.reserve(sessions);
+    long failures = 0;
+
+    // Silence the per-session output while measuring
+    tcpSegments.enabled = true;
+    std::cout.setstate(std::ios_base::badbit);
+    for (long i = 0; i < sessions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = session();
+        auto end = std::chrono::steady_clock::now();
+        if (ok) {
+            latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        } else {
+            failures++;
+        }
+    }
+    std::cout.clear();
+
+    if (latencies.empty()) {
+        std::cerr << "ERROR: No session succeeded" << std::endl;
+        return false;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    std::cout << "BENCH: sessions " << sessions << ", failed " << failures
+              << ", p50 " << percentile(0.50) << " us"
+              << ", p90 " << percentile(0.90) << " us"
+              << ", p99 " << percentile(0.99) << " us"
+              << ", p99.9 " << percentile(0.999) << " us"
+              << ", max " << latencies.back() << " us" << std::endl;
+    if (tcpSegments.sessions > 0) {
+        double n = tcpSegments.sessions;
+        std::cout << "BENCH: TCP segments per session, from server " << tcpSegments.in / n
+                  << " (data " << tcpSegments.dataIn / n << "), to server " << tcpSegments.out / n
+                  << std::endl;
+    }
+    return failures == 0;
+}
+
+// Open-loop load at a fixed rate; ANY runs TCP and then UDP, and the results
+// of both go to PREFIX.json and PREFIX.csv
+bool runLoad(LoadConfig config, Protocol protocol, ApiType apiType, const addrinfo* tcpAddrInfo, const addrinfo* udpAddrInfo, const std::string& outPrefix) {
+    if (protocol == Protocol::SHM) {
+        throw std::runtime_error("Load mode supports TCP and UDP");
+    }
+    config.api = apiType == ApiType::TEXT ? LOAD_TEXT : LOAD_BINARY;
+    std::vector<LoadResult> results;
+    for (const addrinfo* addrInfo : {tcpAddrInfo, udpAddrInfo}) {
+        if (!addrInfo) {
+            continue;
+        }
+        config.transport = addrInfo == tcpAddrInfo ? LOAD_TCP : LOAD_UDP;
+        memcpy(&config.addr, addrInfo->ai_addr, addrInfo->ai_addrlen);
+        config.addrLen = addrInfo->ai_addrlen;
+        results.emplace_back();
+        LoadResult& r = results.back();
+        if (!loadRun(config, &r)) {
+            throw std::runtime_error("Invalid load parameters");
+        }
+        const Histogram& h = r.latency;
+        std::cout << "LOAD: " << loadTransportName(r.transport) << " " << loadApiName(r.api)
+                  << ", rate " << r.rate << "/s, started " << r.started << ", completed " << r.completed
+                  << ", failed " << r.failed << ", timeouts " << r.timeouts << ", unsent " << r.unsent
+                  << ", p50 " << h.quantile(0.50) / 1e3 << " us"
+                  << ", p99 " << h.quantile(0.99) / 1e3 << " us"
+                  << ", p99.9 " << h.quantile(0.999) / 1e3 << " us"
+                  << ", max " << h.max() / 1e3 << " us" << std::endl;
+    }
+    if (!outPrefix.empty()) {
+        std::string json = outPrefix + ".json";
+        std::string csv = outPrefix + ".csv";
+        if (!loadWriteJson(json.c_str(), results) || !loadWriteCsv(csv.c_str(), results)) {
+            throw std::runtime_error("Could not write " + json + " or " + csv);
+        }
+    }
+    for (const LoadResult& r : results) {
+        if (r.completed == 0 || r.failed + r.timeouts > 0) {
             return false;
         }
-        
-        // Send acceptance
-        std::string acceptMsg = "TEXT TCP 1.1 OK\n";
-        if (send(sockfd, acceptMsg.c_str(), acceptMsg.length(), 0) < 0) {
+    }
+    return true;
+}
+
+// Solve an assignment through the operator registry (operators.h)
+bool solve(const Operator* op, const std::string& opName, int32_t value1, int32_t value2, int32_t& result) {
+    if (!op) {
+        std::cerr << "ERROR: Unknown operation: " << opName << std::endl;
+        return false;
+    }
+    if (!opSolve(op, value1, value2, &result)) {
+        std::cerr << "ERROR: " << op->name << " " << value1 << " " << value2 << " has no result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Agree on <apiType> with the server. With a cached ticket the client sends
+// a resume frame at once and gets a one-byte answer, otherwise (or when the
+// server refuses the ticket) it reads the protocol list and answers with a
+// line. Returns false if the server does not offer the API
+bool negotiateTCP(int sockfd, TcpReader& in, const std::string& endpoint, ApiType apiType, uint32_t traceId) {
+    uint32_t want = apiType == ApiType::TEXT ? CAPS_TEXT_TCP : CAPS_BINARY_TCP;
+    uint64_t t0 = traceNow();
+    int verdict = -1; // CAPS_ACK or CAPS_NAK, once the server answered a resume frame
+    bool resuming = false;
+    ProtocolCaps kept = {0, 0};
+    auto cached = capsCache.entries.find(endpoint);
+    if (capsCache.enabled && cached != capsCache.entries.end() && (cached->second.caps & want)) {
+        char frame[CAPS_RESUME_LEN];
+        kept = cached->second;
+        encodeResume(frame, want, kept.ticket);
+        // Forgotten until the server takes it or offers a new one, so a server
+        // that no longer speaks CAPS costs one failed session, not every one
+        capsCache.entries.erase(cached);
+        resuming = true;
+        if (send(sockfd, frame, sizeof(frame), 0) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
-        
-        // Read assignment
-        std::string assignment;
-        char ch;
-        while (recv(sockfd, &ch, 1, 0) > 0) {
-            if (ch == '\n') break;
-            assignment += ch;
+        int b = in.peek();
+        if (b == CAPS_ACK || b == CAPS_NAK) {
+            in.skip(1);
+            verdict = b;
         }
+    }
+
+    ProtocolCaps offered = {0, 0};
+    if (verdict != CAPS_ACK) {
+        // The list ends with an empty line
+        for (std::string line = in.line(); !line.empty(); line = in.line()) {
+            parseCapsLine(line.data(), line.size(), &offered);
+        }
+        if (resuming && verdict < 0) {
+            // The list went out before the server saw the frame, the answer follows it
+            verdict = in.peek();
+            in.skip(1);
+            if (verdict != CAPS_ACK && verdict != CAPS_NAK) {
+                throw std::runtime_error("Invalid answer to resume");
+            }
+        }
+        traceSpan(traceId, TRACE_PROTOCOL_LIST, t0, traceNow());
+    }
+    if (offered.caps & CAPS_RESUME) {
+        capsCache.entries[endpoint] = offered;
+    } else if (verdict == CAPS_ACK) {
+        capsCache.entries[endpoint] = kept;
+    }
+    if (verdict == CAPS_ACK) {
+        traceSpan(traceId, TRACE_CHOICE, t0, traceNow());
+        return true;
+    }
+
+    if (!(offered.caps & want)) {
+        std::cerr << "ERROR: MISSMATCH PROTOCOL" << std::endl;
+        return false;
+    }
+
+    // Send acceptance
+    t0 = traceNow();
+    std::string acceptMsg = apiType == ApiType::TEXT ? "TEXT TCP 1.1 OK\n" : "BINARY TCP 1.1 OK\n";
+    if (send(sockfd, acceptMsg.c_str(), acceptMsg.length(), 0) < 0) {
+        throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
+    }
+    traceSpan(traceId, TRACE_CHOICE, t0, traceNow());
+    return true;
+}
+
+bool handleTCPText(int sockfd, const std::string& endpoint) {
+    try {
+        uint32_t traceId = traceBegin();
+        TcpReader in(sockfd);
+        if (!negotiateTCP(sockfd, in, endpoint, ApiType::TEXT, traceId)) {
+            return false;
+        }
+        uint64_t t1 = traceNow();
+
+        // Read assignment
+        std::string assignment = in.line();
+        uint64_t t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
         
         std::cout << "ASSIGNMENT: " << assignment << std::endl;
         
         // Parse and calculate
-        std::istringstream iss(assignment);
-        std::string op, val1Str, val2Str;
-        iss >> op >> val1Str >> val2Str;
-        
-        if (iss.fail()) {
+        TextAssignment task;
+        if (!parseTextAssignment(assignment.data(), assignment.size(), &task)) {
             std::cerr << "ERROR: Invalid assignment format" << std::endl;
             return false;
         }
         
-        int val1 = std::stoi(val1Str);
-        int val2 = std::stoi(val2Str);
-        int result;
-        
-        if (op == "add") {
-            result = val1 + val2;
-        } else if (op == "sub") {
-            result = val1 - val2;
-        } else if (op == "mul") {
-            result = val1 * val2;
-        } else if (op == "div") {
-            if (val2 == 0) {
-                std::cerr << "ERROR: Division by zero" << std::endl;
-                return false;
-            }
-            result = val1 / val2;
-        } else {
-            std::cerr << "ERROR: Unknown operation: " << op << std::endl;
+        int32_t result;
+        if (!solve(task.op, std::string(task.name, task.nameLen), task.value1, task.value2, result)) {
             return false;
         }
+        t1 = traceNow();
+        traceSpan(traceId, TRACE_VERIFY, t0, t1);
         
         // Send result
         std::string resultStr = std::to_string(result) + "\n";
         if (send(sockfd, resultStr.c_str(), resultStr.length(), 0) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, t1, t0);
         
         // Read response
-        std::string response;
-        while (recv(sockfd, &ch, 1, 0) > 0) {
-            if (ch == '\n') break;
-            response += ch;
-        }
+        std::string response = in.line();
+        traceSpan(traceId, TRACE_RESULT, t0, traceNow());
         
         if (response == "OK") {
             std::cout << "OK" << std::endl;
@@ -336,126 +654,54 @@ bool handleTCPText(int sockfd) {
     }
 }
 
-bool handleTCPBinary(int sockfd) {
+bool handleTCPBinary(int sockfd, const std::string& endpoint) {
     try {
-        // Read server protocols
-        std::vector<std::string> protocols;
-        char buffer[1024];
-        std::string data;
-        
-        while (true) {
-            ssize_t bytesRead = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-            if (bytesRead <= 0) {
-                throw std::runtime_error("Connection closed by server");
-            }
-            
-            buffer[bytesRead] = '\0';
-            data += buffer;
-            
-            size_t pos = data.find('\n');
-            if (pos != std::string::npos) {
-                std::istringstream iss(data.substr(0, pos));
-                std::string line;
-                while (std::getline(iss, line)) {
-                    if (line.empty()) break;
-                    protocols.push_back(line);
-                }
-                break;
-            }
-        }
-        
-        // Check if BINARY TCP 1.1 is supported
-        bool binaryTcp11Supported = false;
-        for (const auto& p : protocols) {
-            if (p == "BINARY TCP 1.1") {
-                binaryTcp11Supported = true;
-                break;
-            }
-        }
-        
-        if (!binaryTcp11Supported) {
-            std::cerr << "ERROR: MISSMATCH PROTOCOL" << std::endl;
+        uint32_t traceId = traceBegin();
+        TcpReader in(sockfd);
+        if (!negotiateTCP(sockfd, in, endpoint, ApiType::BINARY, traceId)) {
             return false;
         }
-        
-        // Send acceptance
-        std::string acceptMsg = "BINARY TCP 1.1 OK\n";
-        if (send(sockfd, acceptMsg.c_str(), acceptMsg.length(), 0) < 0) {
-            throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
-        }
-        
+        uint64_t t1 = traceNow();
+
         // Read binary protocol message
-        CalcProtocol calcProto;
-        ssize_t totalRead = 0;
-        while (totalRead < sizeof(CalcProtocol) - sizeof(int32_t)) { // -4 because in_result is not sent by server
-            ssize_t bytesRead = recv(sockfd, reinterpret_cast<char*>(&calcProto) + totalRead, 
-                                    sizeof(CalcProtocol) - sizeof(int32_t) - totalRead, 0);
-            if (bytesRead <= 0) {
-                throw std::runtime_error("Connection closed by server");
-            }
-            totalRead += bytesRead;
-        }
-        
-        // Convert from network byte order
-        calcProto.type = ntohs(calcProto.type);
-        calcProto.major_version = ntohs(calcProto.major_version);
-        calcProto.minor_version = ntohs(calcProto.minor_version);
-        calcProto.id = ntohl(calcProto.id);
-        calcProto.arith = ntohl(calcProto.arith);
-        calcProto.in_value1 = ntohl(calcProto.in_value1);
-        calcProto.in_value2 = ntohl(calcProto.in_value2);
+        char frame[sizeof(calcProtocol)];
+        in.exact(frame, sizeof(calcProtocol));
+        uint64_t t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
         
-        if (calcProto.type != CALC_PROTOCOL_TYPE) {
+        ProtocolFields calcProto;
+        if (!decodeProtocol(frame, sizeof(calcProtocol), &calcProto) || calcProto.type != CALC_PROTOCOL_TYPE) {
             std::cerr << "ERROR: Invalid message type" << std::endl;
             return false;
         }
         
         // Calculate result
         int32_t result;
-        if (calcProto.arith == 0) { // add
-            result = calcProto.in_value1 + calcProto.in_value2;
-        } else if (calcProto.arith == 1) { // sub
-            result = calcProto.in_value1 - calcProto.in_value2;
-        } else if (calcProto.arith == 2) { // mul
-            result = calcProto.in_value1 * calcProto.in_value2;
-        } else if (calcProto.arith == 3) { // div
-            if (calcProto.in_value2 == 0) {
-                std::cerr << "ERROR: Division by zero" << std::endl;
-                return false;
-            }
-            result = calcProto.in_value1 / calcProto.in_value2;
-        } else {
-            std::cerr << "ERROR: Unknown arithmetic operation: " << calcProto.arith << std::endl;
+        if (!solve(opByCode(calcProto.arith), std::to_string(calcProto.arith), calcProto.value1, calcProto.value2, result)) {
             return false;
         }
+        t1 = traceNow();
+        traceSpan(traceId, TRACE_VERIFY, t0, t1);
         
         // Prepare response
-        CalcProtocol responseProto;
-        responseProto.type = htons(CALC_PROTOCOL_TYPE);
-        responseProto.major_version = htons(MAJOR_VERSION);
-        responseProto.minor_version = htons(MINOR_VERSION);
-        responseProto.id = htonl(calcProto.id);
-        responseProto.arith = htonl(calcProto.arith);
-        responseProto.in_value1 = htonl(calcProto.in_value1);
-        responseProto.in_value2 = htonl(calcProto.in_value2);
-        responseProto.in_result = htonl(result);
+        ProtocolFields answer = {CALC_ANSWER_TYPE, MAJOR_VERSION, MINOR_VERSION, calcProto.id,
+                                 calcProto.arith, calcProto.value1, calcProto.value2, result};
+        calcProtocol responseProto = encodeProtocol(answer);
         
         // Send response
         if (send(sockfd, &responseProto, sizeof(responseProto), 0) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, t1, t0);
         
         // Read server response
-        char responseBuffer[1024];
-        ssize_t bytesRead = recv(sockfd, responseBuffer, sizeof(responseBuffer) - 1, 0);
-        if (bytesRead <= 0) {
-            throw std::runtime_error("Connection closed by server");
-        }
+        in.exact(frame, sizeof(calcMessage));
+        traceSpan(traceId, TRACE_RESULT, t0, traceNow());
         
-        responseBuffer[bytesRead] = '\0';
-        std::string response(responseBuffer);
-        
-        if (response.find("OK") != std::string::npos) {
+        MessageFields responseMsg;
+        decodeMessage(frame, sizeof(calcMessage), &responseMsg);
+        if (responseMsg.type == SERVER_MESSAGE_TYPE && responseMsg.message == 1) {
             std::cout << "OK" << std::endl;
             return true;
         } else {
@@ -478,12 +724,17 @@ bool handleUDPText(int sockfd, const struct sockaddr_in& server_addr) {
             throw std::runtime_error("Setsockopt failed: " + std::string(strerror(errno)));
         }
         
+        uint32_t traceId = traceBegin();
+        uint64_t t0 = traceNow();
+
         // Send initial message
         std::string initMsg = "TEXT UDP 1.1\n";
         if (sendto(sockfd, initMsg.c_str(), initMsg.length(), 0, 
                   (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
+        uint64_t t1 = traceNow();
+        traceSpan(traceId, TRACE_CHOICE, t0, t1);
         
         // Receive assignment
         char buffer[1024];
@@ -499,40 +750,25 @@ bool handleUDPText(int sockfd, const struct sockaddr_in& server_addr) {
             return false;
         }
         
-        buffer[bytesRead] = '\0';
-        std::string assignment(buffer);
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
+        
+        std::string assignment(buffer, bytesRead);
         std::cout << "ASSIGNMENT: " << assignment << std::endl;
         
         // Parse and calculate
-        std::istringstream iss(assignment);
-        std::string op, val1Str, val2Str;
-        iss >> op >> val1Str >> val2Str;
-        
-        if (iss.fail()) {
+        TextAssignment task;
+        if (!parseTextAssignment(assignment.data(), assignment.size(), &task)) {
             std::cerr << "ERROR: Invalid assignment format" << std::endl;
             return false;
         }
         
-        int val1 = std::stoi(val1Str);
-        int val2 = std::stoi(val2Str);
-        int result;
-        
-        if (op == "add") {
-            result = val1 + val2;
-        } else if (op == "sub") {
-            result = val1 - val2;
-        } else if (op == "mul") {
-            result = val1 * val2;
-        } else if (op == "div") {
-            if (val2 == 0) {
-                std::cerr << "ERROR: Division by zero" << std::endl;
-                return false;
-            }
-            result = val1 / val2;
-        } else {
-            std::cerr << "ERROR: Unknown operation: " << op << std::endl;
+        int32_t result;
+        if (!solve(task.op, std::string(task.name, task.nameLen), task.value1, task.value2, result)) {
             return false;
         }
+        t1 = traceNow();
+        traceSpan(traceId, TRACE_VERIFY, t0, t1);
         
         // Send result
         std::string resultStr = std::to_string(result) + "\n";
@@ -540,6 +776,8 @@ bool handleUDPText(int sockfd, const struct sockaddr_in& server_addr) {
                   (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, t1, t0);
         
         // Receive response
         bytesRead = recvfrom(sockfd, buffer, sizeof(buffer) - 1, 0, 
@@ -553,10 +791,12 @@ bool handleUDPText(int sockfd, const struct sockaddr_in& server_addr) {
             return false;
         }
         
+        traceSpan(traceId, TRACE_RESULT, t0, traceNow());
+        
         buffer[bytesRead] = '\0';
         std::string response(buffer);
         
-        if (response == "OK") {
+        if (response == "OK\n" || response == "OK") {
             std::cout << "OK" << std::endl;
             return true;
         } else {
@@ -579,18 +819,19 @@ bool handleUDPBinary(int sockfd, const struct sockaddr_in& server_addr) {
             throw std::runtime_error("Setsockopt failed: " + std::string(strerror(errno)));
         }
         
+        uint32_t traceId = traceBegin();
+        uint64_t t0 = traceNow();
+
         // Create and send initial message
-        CalcMessage initMsg;
-        initMsg.type = htons(CALC_MESSAGE_TYPE);
-        initMsg.message = htons(0);
-        initMsg.protocol = htons(PROTOCOL_ID);
-        initMsg.major_version = htons(MAJOR_VERSION);
-        initMsg.minor_version = htons(MINOR_VERSION);
+        MessageFields hello = {CALC_MESSAGE_TYPE, 0, PROTOCOL_ID, MAJOR_VERSION, MINOR_VERSION};
+        calcMessage initMsg = encodeMessage(hello);
         
         if (sendto(sockfd, &initMsg, sizeof(initMsg), 0, 
                   (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
             throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
         }
+        uint64_t t1 = traceNow();
+        traceSpan(traceId, TRACE_CHOICE, t0, t1);
         
         // Receive response
         char buffer[1024];
@@ -605,68 +846,43 @@ bool handleUDPBinary(int sockfd, const struct sockaddr_in& server_addr) {
             }
             return false;
         }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
         
-        if (bytesRead == sizeof(CalcMessage)) {
+        MessageFields msg;
+        ProtocolFields calcProto;
+        if (decodeMessage(buffer, bytesRead, &msg)) {
             // Check if it's an error message
-            CalcMessage* msg = reinterpret_cast<CalcMessage*>(buffer);
-            msg->type = ntohs(msg->type);
-            msg->message = ntohs(msg->message);
-            
-            if (msg->type == ERROR_MESSAGE_TYPE && msg->message == 2) {
+            if (msg.type == SERVER_MESSAGE_TYPE && msg.message == 2) {
                 std::cerr << "ERROR: Server does not support the protocol" << std::endl;
                 return false;
             }
-        } else if (bytesRead == sizeof(CalcProtocol) - sizeof(int32_t)) { // -4 because in_result is not sent by server
-            // Parse the CalcProtocol message
-            CalcProtocol* calcProto = reinterpret_cast<CalcProtocol*>(buffer);
-            calcProto->type = ntohs(calcProto->type);
-            calcProto->major_version = ntohs(calcProto->major_version);
-            calcProto->minor_version = ntohs(calcProto->minor_version);
-            calcProto->id = ntohl(calcProto->id);
-            calcProto->arith = ntohl(calcProto->arith);
-            calcProto->in_value1 = ntohl(calcProto->in_value1);
-            calcProto->in_value2 = ntohl(calcProto->in_value2);
-            
-            if (calcProto->type != CALC_PROTOCOL_TYPE) {
+        } else if (decodeProtocol(buffer, bytesRead, &calcProto)) {
+            if (calcProto.type != CALC_PROTOCOL_TYPE) {
                 std::cerr << "ERROR: Invalid message type" << std::endl;
                 return false;
             }
             
             // Calculate result
             int32_t result;
-            if (calcProto->arith == 0) { // add
-                result = calcProto->in_value1 + calcProto->in_value2;
-            } else if (calcProto->arith == 1) { // sub
-                result = calcProto->in_value1 - calcProto->in_value2;
-            } else if (calcProto->arith == 2) { // mul
-                result = calcProto->in_value1 * calcProto->in_value2;
-            } else if (calcProto->arith == 3) { // div
-                if (calcProto->in_value2 == 0) {
-                    std::cerr << "ERROR: Division by zero" << std::endl;
-                    return false;
-                }
-                result = calcProto->in_value1 / calcProto->in_value2;
-            } else {
-                std::cerr << "ERROR: Unknown arithmetic operation: " << calcProto->arith << std::endl;
+            if (!solve(opByCode(calcProto.arith), std::to_string(calcProto.arith), calcProto.value1, calcProto.value2, result)) {
                 return false;
             }
+            t1 = traceNow();
+            traceSpan(traceId, TRACE_VERIFY, t0, t1);
             
             // Prepare response
-            CalcProtocol responseProto;
-            responseProto.type = htons(CALC_PROTOCOL_TYPE);
-            responseProto.major_version = htons(MAJOR_VERSION);
-            responseProto.minor_version = htons(MINOR_VERSION);
-            responseProto.id = htonl(calcProto->id);
-            responseProto.arith = htonl(calcProto->arith);
-            responseProto.in_value1 = htonl(calcProto->in_value1);
-            responseProto.in_value2 = htonl(calcProto->in_value2);
-            responseProto.in_result = htonl(result);
+            ProtocolFields answer = {CALC_ANSWER_TYPE, MAJOR_VERSION, MINOR_VERSION, calcProto.id,
+                                     calcProto.arith, calcProto.value1, calcProto.value2, result};
+            calcProtocol responseProto = encodeProtocol(answer);
             
             // Send response
             if (sendto(sockfd, &responseProto, sizeof(responseProto), 0, 
                       (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
                 throw std::runtime_error("Send failed: " + std::string(strerror(errno)));
             }
+            t0 = traceNow();
+            traceSpan(traceId, TRACE_ANSWER, t1, t0);
             
             // Receive final response
             bytesRead = recvfrom(sockfd, buffer, sizeof(buffer), 0, 
@@ -679,13 +895,11 @@ bool handleUDPBinary(int sockfd, const struct sockaddr_in& server_addr) {
                 }
                 return false;
             }
+            traceSpan(traceId, TRACE_RESULT, t0, traceNow());
             
-            if (bytesRead == sizeof(CalcMessage)) {
-                CalcMessage* responseMsg = reinterpret_cast<CalcMessage*>(buffer);
-                responseMsg->type = ntohs(responseMsg->type);
-                responseMsg->message = ntohs(responseMsg->message);
-                
-                if (responseMsg->type == CALC_MESSAGE_TYPE && responseMsg->message == 1) {
+            MessageFields responseMsg;
+            if (decodeMessage(buffer, bytesRead, &responseMsg)) {
+                if (responseMsg.type == SERVER_MESSAGE_TYPE && responseMsg.message == 1) {
                     std::cout << "OK" << std::endl;
                     return true;
                 } else {
@@ -706,4 +920,152 @@ bool handleUDPBinary(int sockfd, const struct sockaddr_in& server_addr) {
     }
     
     return false;
-}
\ No newline at end of file
+}
+
+// Receive one frame from the server, false (reported) on timeout
+static bool recvSHMFrame(ShmEndpoint* endpoint, char* buffer, size_t size, int& length) {
+    length = shmRecv(endpoint, buffer, size, SHM_SPIN_US, SHM_TIMEOUT_MS);
+    if (length < 0) {
+        throw std::runtime_error("Shared-memory channel is corrupt");
+    }
+    if (length == 0) {
+        std::cerr << "ERROR: MESSAGE LOST (TIMEOUT)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Shared memory carries the UDP session frames, one ring slot per datagram
+bool handleSHMText(ShmEndpoint* endpoint) {
+    try {
+        uint32_t traceId = traceBegin();
+        uint64_t t0 = traceNow();
+
+        std::string initMsg = "TEXT UDP 1.1\n";
+        if (!shmSend(endpoint, initMsg.data(), initMsg.size())) {
+            throw std::runtime_error("Send failed: ring full");
+        }
+        uint64_t t1 = traceNow();
+        traceSpan(traceId, TRACE_CHOICE, t0, t1);
+
+        char buffer[SHM_MAX_FRAME + 1];
+        int length;
+        if (!recvSHMFrame(endpoint, buffer, SHM_MAX_FRAME, length)) {
+            return false;
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
+
+        std::string assignment(buffer, length);
+        std::cout << "ASSIGNMENT: " << assignment << std::endl;
+
+        TextAssignment task;
+        if (!parseTextAssignment(assignment.data(), assignment.size(), &task)) {
+            std::cerr << "ERROR: Invalid assignment format" << std::endl;
+            return false;
+        }
+
+        int32_t result;
+        if (!solve(task.op, std::string(task.name, task.nameLen), task.value1, task.value2, result)) {
+            return false;
+        }
+        t1 = traceNow();
+        traceSpan(traceId, TRACE_VERIFY, t0, t1);
+
+        std::string resultStr = std::to_string(result) + "\n";
+        if (!shmSend(endpoint, resultStr.data(), resultStr.size())) {
+            throw std::runtime_error("Send failed: ring full");
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, t1, t0);
+
+        if (!recvSHMFrame(endpoint, buffer, SHM_MAX_FRAME, length)) {
+            return false;
+        }
+        traceSpan(traceId, TRACE_RESULT, t0, traceNow());
+
+        std::string response(buffer, length);
+        if (response == "OK\n" || response == "OK") {
+            std::cout << "OK" << std::endl;
+            return true;
+        }
+        std::cout << "ERROR" << std::endl;
+        return false;
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+bool handleSHMBinary(ShmEndpoint* endpoint) {
+    try {
+        uint32_t traceId = traceBegin();
+        uint64_t t0 = traceNow();
+
+        MessageFields hello = {CALC_MESSAGE_TYPE, 0, PROTOCOL_ID, MAJOR_VERSION, MINOR_VERSION};
+        calcMessage initMsg = encodeMessage(hello);
+        if (!shmSend(endpoint, &initMsg, sizeof(initMsg))) {
+            throw std::runtime_error("Send failed: ring full");
+        }
+        uint64_t t1 = traceNow();
+        traceSpan(traceId, TRACE_CHOICE, t0, t1);
+
+        char buffer[SHM_MAX_FRAME];
+        int length;
+        if (!recvSHMFrame(endpoint, buffer, sizeof(buffer), length)) {
+            return false;
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ASSIGNMENT, t1, t0);
+
+        if (length == sizeof(calcMessage)) {
+            std::cerr << "ERROR: Server does not support the protocol" << std::endl;
+            return false;
+        }
+        ProtocolFields calcProto;
+        if (!decodeProtocol(buffer, length, &calcProto)) {
+            std::cerr << "ERROR: Invalid message size" << std::endl;
+            return false;
+        }
+        if (calcProto.type != CALC_PROTOCOL_TYPE) {
+            std::cerr << "ERROR: Invalid message type" << std::endl;
+            return false;
+        }
+        int32_t result;
+        if (!solve(opByCode(calcProto.arith), std::to_string(calcProto.arith), calcProto.value1, calcProto.value2, result)) {
+            return false;
+        }
+        t1 = traceNow();
+        traceSpan(traceId, TRACE_VERIFY, t0, t1);
+
+        // Echo the assignment back with the result filled in
+        calcProto.type = CALC_ANSWER_TYPE;
+        calcProto.result = result;
+        calcProtocol answer = encodeProtocol(calcProto);
+        if (!shmSend(endpoint, &answer, sizeof(answer))) {
+            throw std::runtime_error("Send failed: ring full");
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, t1, t0);
+
+        if (!recvSHMFrame(endpoint, buffer, sizeof(buffer), length)) {
+            return false;
+        }
+        traceSpan(traceId, TRACE_RESULT, t0, traceNow());
+
+        MessageFields responseMsg;
+        if (!decodeMessage(buffer, length, &responseMsg)) {
+            std::cerr << "ERROR: Invalid response size" << std::endl;
+            return false;
+        }
+        if (responseMsg.type == SERVER_MESSAGE_TYPE && responseMsg.message == 1) {
+            std::cout << "OK" << std::endl;
+            return true;
+        }
+        std::cout << "ERROR" << std::endl;
+        return false;
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return false;
+    }
+}
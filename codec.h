@@ -0,0 +1,252 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "operators.h"
+
+/*
+   Decoding and encoding of everything that crosses the wire, shared by the
+   server, the client, the load generator and the batch solver.
+
+   The decoders take untrusted bytes. A binary message must have exactly the
+   size of its struct; it is copied out of the buffer (the packed structs are
+   never accessed in place) into host byte order fields. Text is parsed
+   within [data, data + len), which need not be NUL terminated, and a number
+   must fit in 32 bits: nothing is truncated or read past <len>.
+
+   The decoders only check the shape. Whether a type or version is the one
+   expected is up to the caller.
+*/
+
+/* calcProtocol in host byte order. */
+struct ProtocolFields {
+  uint16_t type;
+  uint16_t major;
+  uint16_t minor;
+  uint32_t id;
+  uint32_t arith;
+  int32_t value1;
+  int32_t value2;
+  int32_t result;
+};
+
+/* calcMessage in host byte order. */
+struct MessageFields {
+  uint16_t type;
+  uint32_t message;
+  uint16_t protocol;
+  uint16_t major;
+  uint16_t minor;
+};
+
+static inline bool decodeProtocol(const void *data, size_t len, ProtocolFields *f) {
+  if (len != sizeof(calcProtocol)) {
+    return false;
+  }
+  calcProtocol p;
+  memcpy(&p, data, sizeof(p));
+  f->type = ntohs(p.type);
+  f->major = ntohs(p.major_version);
+  f->minor = ntohs(p.minor_version);
+  f->id = ntohl(p.id);
+  f->arith = ntohl(p.arith);
+  f->value1 = (int32_t)ntohl((uint32_t)p.inValue1);
+  f->value2 = (int32_t)ntohl((uint32_t)p.inValue2);
+  f->result = (int32_t)ntohl((uint32_t)p.inResult);
+  return true;
+}
+
+static inline calcProtocol encodeProtocol(const ProtocolFields &f) {
+  calcProtocol p;
+  p.type = htons(f.type);
+  p.major_version = htons(f.major);
+  p.minor_version = htons(f.minor);
+  p.id = htonl(f.id);
+  p.arith = htonl(f.arith);
+  p.inValue1 = (int32_t)htonl((uint32_t)f.value1);
+  p.inValue2 = (int32_t)htonl((uint32_t)f.value2);
+  p.inResult = (int32_t)htonl((uint32_t)f.result);
+  return p;
+}
+
+static inline bool decodeMessage(const void *data, size_t len, MessageFields *f) {
+  if (len != sizeof(calcMessage)) {
+    return false;
+  }
+  calcMessage m;
+  memcpy(&m, data, sizeof(m));
+  f->type = ntohs(m.type);
+  f->message = ntohl(m.message);
+  f->protocol = ntohs(m.protocol);
+  f->major = ntohs(m.major_version);
+  f->minor = ntohs(m.minor_version);
+  return true;
+}
+
+static inline calcMessage encodeMessage(const MessageFields &f) {
+  calcMessage m;
+  m.type = htons(f.type);
+  m.message = htonl(f.message);
+  m.protocol = htons(f.protocol);
+  m.major_version = htons(f.major);
+  m.minor_version = htons(f.minor);
+  return m;
+}
+
+static inline bool textBlank(char c) { return c == ' ' || c == '\t'; }
+
+/* A signed 32-bit decimal at *pp, no blanks. Advances *pp past it. */
+static inline bool parseTextInt(const char **pp, const char *end, int32_t *value) {
+  const char *p = *pp;
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+  const char *digits = p;
+  int64_t v = 0;
+  while (p < end && *p >= '0' && *p <= '9' && v <= 2147483648LL) {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  if (p == digits || v > 2147483647LL + neg) {
+    return false;
+  }
+  *value = (int32_t)(neg ? -v : v);
+  *pp = p;
+  return true;
+}
+
+/* Nothing but blanks and line ends from p on. */
+static inline bool textRestEmpty(const char *p, const char *end) {
+  while (p < end && (textBlank(*p) || *p == '\r' || *p == '\n')) p++;
+  return p == end;
+}
+
+/* A text assignment as it was parsed. <op> is NULL for a well-formed line
+   that names no operator; <name> points into the line. */
+struct TextAssignment {
+  const char *name;
+  size_t nameLen;
+  const Operator *op;
+  int32_t value1;
+  int32_t value2;
+};
+
+/* "name a b": blanks before and between the fields, blanks and a line end
+   after them, nothing else. */
+static inline bool parseTextAssignment(const char *data, size_t len, TextAssignment *t) {
+  const char *p = data;
+  const char *end = data + len;
+  while (p < end && textBlank(*p)) p++;
+  t->name = p;
+  while (p < end && !textBlank(*p)) p++;
+  t->nameLen = p - t->name;
+  if (t->nameLen == 0) {
+    return false;
+  }
+  int32_t *values[2] = {&t->value1, &t->value2};
+  for (int i = 0; i < 2; i++) {
+    if (p == end || !textBlank(*p)) {
+      return false;
+    }
+    while (p < end && textBlank(*p)) p++;
+    if (!parseTextInt(&p, end, values[i])) {
+      return false;
+    }
+  }
+  t->op = opByName(t->name, t->nameLen);
+  return textRestEmpty(p, end);
+}
+
+/* A text answer: one integer, blanks around it, optionally a line end. */
+static inline bool parseTextAnswer(const char *data, size_t len, int32_t *value) {
+  const char *p = data;
+  const char *end = data + len;
+  while (p < end && textBlank(*p)) p++;
+  return parseTextInt(&p, end, value) && textRestEmpty(p, end);
+}
+
+/*
+   TCP capabilities. Next to the protocol list ("TEXT TCP 1.1\n..."), which
+   legacy clients read and ignore the rest of, the server announces one line
+
+     "CAPS <hex bitmap> <16 hex digit ticket>"
+
+   A client that kept both for this server can open its next connection with
+   a resume frame instead of waiting for the list:
+
+     client: CAPS_RESUME_MARKER, the CAPS_* bit it chooses, the ticket (8
+             bytes, big endian)
+     server: CAPS_ACK and the assignment, or CAPS_NAK and the list (unless it
+             went out already) and the session goes on with the line choice
+
+   The list may still come first when the frame arrives after the server
+   started the session; the ACK or NAK follows it then. A legacy choice line
+   never starts with CAPS_RESUME_MARKER.
+*/
+#define CAPS_TEXT_TCP 0x1u
+#define CAPS_BINARY_TCP 0x2u
+#define CAPS_RESUME 0x4u
+#define CAPS_RESUME_MARKER 0xca
+#define CAPS_RESUME_LEN 10
+#define CAPS_ACK 0x06
+#define CAPS_NAK 0x15
+
+struct ProtocolCaps {
+  uint32_t caps;   // CAPS_* bits.
+  uint64_t ticket; // Valid with CAPS_RESUME.
+};
+
+/* One line of the protocol list, without its line end: ORs what it offers
+   into <c>. Unknown lines are skipped, as a legacy client would. */
+static inline void parseCapsLine(const char *data, size_t len, ProtocolCaps *c) {
+  if (len == 12 && memcmp(data, "TEXT TCP 1.1", 12) == 0) {
+    c->caps |= CAPS_TEXT_TCP;
+  } else if (len == 14 && memcmp(data, "BINARY TCP 1.1", 14) == 0) {
+    c->caps |= CAPS_BINARY_TCP;
+  } else if (len > 5 && memcmp(data, "CAPS ", 5) == 0) {
+    const char *p = data + 5;
+    const char *end = data + len;
+    uint64_t fields[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+      const char *digits = p;
+      while (p < end && p - digits < 16 && isxdigit((unsigned char)*p)) {
+        fields[i] = fields[i] << 4 | (uint64_t)(*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        p++;
+      }
+      if (p == digits || (i == 0 && (p == end || *p++ != ' '))) {
+        return;
+      }
+    }
+    if (p == end && (fields[0] & CAPS_RESUME)) {
+      c->caps |= (uint32_t)fields[0];
+      c->ticket = fields[1];
+    }
+  }
+}
+
+static inline void encodeResume(char frame[CAPS_RESUME_LEN], uint32_t choice, uint64_t ticket) {
+  frame[0] = (char)CAPS_RESUME_MARKER;
+  frame[1] = (char)choice;
+  for (int i = 0; i < 8; i++) {
+    frame[2 + i] = (char)(ticket >> (56 - 8 * i));
+  }
+}
+
+static inline bool decodeResume(const void *data, size_t len, uint32_t *choice, uint64_t *ticket) {
+  const unsigned char *p = (const unsigned char *)data;
+  if (len != CAPS_RESUME_LEN || p[0] != CAPS_RESUME_MARKER) {
+    return false;
+  }
+  *choice = p[1];
+  *ticket = 0;
+  for (int i = 0; i < 8; i++) {
+    *ticket = *ticket << 8 | p[2 + i];
+  }
+  return true;
+}
@@ -0,0 +1,579 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <new>
+
+#include "coro.h"
+
+#define CORO_POOL_CLASS 64  // Frame sizes are rounded up to this.
+#define CORO_POOL_MAX 4096  // Larger frames come straight from operator new.
+#define MAX_DATAGRAM_LINE 1500
+#define CORO_FLUSH_IOV 64   // Chunks per sendmsg().
+
+struct CoroFreeFrame {
+  CoroFreeFrame *next;
+};
+
+struct CoroChunk {
+  CoroChunk *next;
+  uint32_t begin; // Written up to here.
+  uint32_t end;   // Filled up to here.
+  char data[CORO_CHUNK_SIZE - sizeof(CoroChunk *) - 2 * sizeof(uint32_t)];
+};
+
+static_assert(sizeof(CoroChunk) == CORO_CHUNK_SIZE, "chunk layout");
+
+/* Free frames by size class and free output chunks of one thread. A loop
+   reaches its peak number of sessions and then only recycles; what is free
+   goes back when the thread exits, load threads and workers come and go. */
+struct CoroPools {
+  CoroFreeFrame *frames[CORO_POOL_MAX / CORO_POOL_CLASS];
+  CoroChunk *chunks;
+
+  ~CoroPools() {
+    for (size_t i = 0; i < CORO_POOL_MAX / CORO_POOL_CLASS; i++) {
+      while (frames[i] != NULL) {
+        CoroFreeFrame *f = frames[i];
+        frames[i] = f->next;
+        ::operator delete(f);
+      }
+    }
+    while (chunks != NULL) {
+      CoroChunk *c = chunks;
+      chunks = c->next;
+      delete c;
+    }
+  }
+};
+
+static thread_local CoroPools pools;
+
+void *coroFrameAlloc(size_t size) {
+  if (size > CORO_POOL_MAX) {
+    return ::operator new(size);
+  }
+  size_t cls = (size - 1) / CORO_POOL_CLASS;
+  CoroFreeFrame *f = pools.frames[cls];
+  if (f != NULL) {
+    pools.frames[cls] = f->next;
+    return f;
+  }
+  return ::operator new((cls + 1) * CORO_POOL_CLASS);
+}
+
+void coroFrameFree(void *frame, size_t size) {
+  if (size > CORO_POOL_MAX) {
+    ::operator delete(frame);
+    return;
+  }
+  size_t cls = (size - 1) / CORO_POOL_CLASS;
+  CoroFreeFrame *f = (CoroFreeFrame *)frame;
+  f->next = pools.frames[cls];
+  pools.frames[cls] = f;
+}
+
+static thread_local size_t chunkLimit;
+static thread_local CoroOutputStats chunkStats;
+
+void coroSetOutputLimit(size_t chunks) {
+  chunkLimit = chunks;
+}
+
+CoroOutputStats coroOutputStats() {
+  return chunkStats;
+}
+
+static CoroChunk *chunkAlloc() {
+  if (chunkLimit != 0 && chunkStats.chunks >= chunkLimit) {
+    chunkStats.refused++;
+    return NULL;
+  }
+  CoroChunk *c = pools.chunks;
+  if (c != NULL) {
+    pools.chunks = c->next;
+  } else {
+    c = new CoroChunk;
+  }
+  c->next = NULL;
+  c->begin = c->end = 0;
+  if (++chunkStats.chunks > chunkStats.peak) {
+    chunkStats.peak = chunkStats.chunks;
+  }
+  return c;
+}
+
+static void chunkFree(CoroChunk *c) {
+  c->next = pools.chunks;
+  pools.chunks = c;
+  chunkStats.chunks--;
+}
+
+uint64_t coroNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void CoroTimers::run(uint64_t now) {
+  while (!heap.empty() && heap.top().deadline <= now) {
+    std::coroutine_handle<> h = heap.top().handle;
+    heap.pop();
+    h.resume();
+  }
+}
+
+void CoroSignal::notifyOne() {
+  if (waiters.empty()) {
+    return;
+  }
+  std::coroutine_handle<> h = waiters.front();
+  waiters.erase(waiters.begin());
+  h.resume();
+}
+
+void CoroOp::await_suspend(std::coroutine_handle<> h) {
+  conn->park(this, h);
+}
+
+void CoroOutbox::flush() {
+  // Resumed sessions may queue more, or close and leave the list.
+  while (!dirty.empty()) {
+    CoroConn *c = dirty.back();
+    dirty.pop_back();
+    c->inOutbox = false;
+    c->flushSome();
+    c->progress();
+  }
+}
+
+CoroConn::CoroConn()
+  : highWater(0), lowWater(0), epfd(-1), sock(-1), tag(NULL), datagram(false), broken(false),
+    readable(false), blocked(false), last(false), cancelled(false), interest(0), outHead(NULL),
+    outTail(NULL), outBytes(0), blockedAt(0),
+    writeCalls(0), outbox(NULL), inOutbox(false), op(NULL) {}
+
+void CoroConn::attach(int epollFd, int fd, void *epollTag, bool isDatagram, CoroOutbox *batch) {
+  epfd = epollFd;
+  sock = fd;
+  tag = epollTag;
+  datagram = isDatagram;
+  outbox = isDatagram ? NULL : batch;
+  // Sessions start by reading nearly always, so watch for input from the start
+  // rather than try a read that cannot find anything yet.
+  interest = EPOLLIN;
+  struct epoll_event ev;
+  ev.events = interest;
+  ev.data.ptr = tag;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+    broken = true;
+  }
+}
+
+void CoroConn::close() {
+  if (inOutbox) {
+    std::vector<CoroConn *> &d = outbox->dirty;
+    for (size_t i = 0; i < d.size(); i++) {
+      if (d[i] == this) {
+        d[i] = d.back();
+        d.pop_back();
+        break;
+      }
+    }
+    inOutbox = false;
+  }
+  if (sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+  dropOutput();
+}
+
+void CoroConn::dropOutput() {
+  while (outHead != NULL) {
+    CoroChunk *c = outHead;
+    outHead = c->next;
+    chunkFree(c);
+  }
+  outTail = NULL;
+  outBytes = 0;
+}
+
+void CoroConn::cancel() {
+  cancelled = true;
+  if (op != NULL) {
+    // The coroutine may finish and free this conn, so nothing after resume().
+    std::coroutine_handle<> h = waiter;
+    op->poll();
+    op = NULL;
+    h.resume();
+  }
+}
+
+void CoroConn::onEvents(uint32_t events) {
+  if (events & EPOLLERR) {
+    broken = true;
+  }
+  if (events & (EPOLLIN | EPOLLHUP)) {
+    readable = true;
+  }
+  if (events & EPOLLOUT) {
+    flushSome();
+  }
+  if ((events & EPOLLHUP) && op == NULL) {
+    broken = true; // Nobody will read the EOF, and EPOLLHUP cannot be masked.
+  }
+  progress();
+}
+
+void CoroConn::progress() {
+  if (op != NULL && op->poll()) {
+    std::coroutine_handle<> h = waiter;
+    op = NULL;
+    h.resume(); // Last, see cancel().
+    return;
+  }
+  updateInterest(false);
+}
+
+void CoroConn::park(CoroOp *waitingOp, std::coroutine_handle<> h) {
+  op = waitingOp;
+  waiter = h;
+  // A session mostly waits for a send only until the outbox flush at the end
+  // of this iteration, so EPOLLIN is dropped only once it actually fires.
+  updateInterest(true);
+}
+
+void CoroConn::updateInterest(bool keepInput) {
+  if (sock < 0) {
+    return;
+  }
+  uint32_t events = 0;
+  if (!failed()) {
+    events = (blocked ? (uint32_t)EPOLLOUT : 0u) | (op != NULL && op->reads ? (uint32_t)EPOLLIN : 0u);
+    if (keepInput) {
+      events |= interest & EPOLLIN;
+    }
+  }
+  if (events == interest) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = tag;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev);
+  interest = events;
+}
+
+void CoroConn::fill() {
+  char buf[4096];
+  while (readable) {
+    ssize_t n = recv(sock, buf, sizeof(buf), 0);
+    if (n > 0) {
+      in.append(buf, n);
+      if ((size_t)n < sizeof(buf)) {
+        readable = false; // Drained; epoll says when there is more.
+      }
+    } else if (n == 0) {
+      broken = true;
+      readable = false;
+    } else if (errno != EINTR) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        broken = true;
+      }
+      readable = false;
+    }
+  }
+}
+
+/* The chain holds every message queued since the last flush back to back,
+   so one sendmsg() writes them all. The last data of a stream goes with
+   MSG_MORE, which holds it back like TCP_CORK until shutdown() adds the FIN. */
+void CoroConn::flushSome() {
+  bool wasBlocked = blocked;
+  bool moved = false;
+  blocked = false;
+  while (outHead != NULL && !broken) {
+    struct iovec iov[CORO_FLUSH_IOV];
+    int n = 0;
+    for (CoroChunk *c = outHead; c != NULL && n < CORO_FLUSH_IOV; c = c->next) {
+      iov[n].iov_base = c->data + c->begin;
+      iov[n].iov_len = c->end - c->begin;
+      n++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | (last ? MSG_MORE : 0));
+    writeCalls++;
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        blocked = true;
+      } else {
+        broken = true;
+      }
+      break;
+    }
+    moved = moved || sent > 0;
+    outBytes -= sent;
+    while (sent > 0) {
+      CoroChunk *c = outHead;
+      size_t part = c->end - c->begin;
+      if ((size_t)sent < part) {
+        c->begin += sent;
+        break;
+      }
+      sent -= part;
+      outHead = c->next;
+      chunkFree(c);
+    }
+    if (outHead == NULL) {
+      outTail = NULL;
+    }
+  }
+  if (blocked) {
+    if (!wasBlocked || moved) {
+      blockedAt = coroNow();
+    }
+  } else {
+    blockedAt = 0;
+  }
+  if (outHead == NULL && last && !broken) {
+    shutdown(sock, SHUT_WR);
+    last = false;
+  }
+}
+
+CoroConn::RecvLine CoroConn::recvLine(std::string *line, size_t maxLen) {
+  RecvLine r;
+  r.conn = this;
+  r.reads = true;
+  r.line = line;
+  r.maxLen = maxLen;
+  r.ok = false;
+  return r;
+}
+
+bool CoroConn::RecvLine::poll() {
+  if (conn->datagram && !conn->failed()) {
+    if (!conn->readable) {
+      return false;
+    }
+    char buf[MAX_DATAGRAM_LINE];
+    size_t cap = maxLen + 1 < sizeof(buf) ? maxLen + 1 : sizeof(buf);
+    ssize_t n;
+    do {
+      n = recv(conn->sock, buf, cap, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn->readable = false;
+      return false;
+    }
+    if (n < 0) {
+      conn->broken = true;
+    }
+    ok = n > 0 && buf[n - 1] == '\n';
+    if (ok) {
+      size_t len = n > 1 && buf[n - 2] == '\r' ? n - 2 : n - 1;
+      line->assign(buf, len);
+    }
+    return true;
+  }
+  for (;;) {
+    if (conn->cancelled) {
+      ok = false;
+      return true;
+    }
+    size_t pos = conn->in.find('\n');
+    if (pos != std::string::npos) {
+      size_t len = pos > 0 && conn->in[pos - 1] == '\r' ? pos - 1 : pos;
+      line->assign(conn->in, 0, len);
+      conn->in.erase(0, pos + 1);
+      ok = true;
+      return true;
+    }
+    if (conn->in.size() > maxLen || conn->broken) {
+      ok = false;
+      return true;
+    }
+    size_t before = conn->in.size();
+    conn->fill();
+    if (conn->in.size() == before && !conn->broken) {
+      return false;
+    }
+  }
+}
+
+CoroConn::RecvFrame CoroConn::recvFrame(void *buf, size_t len) {
+  RecvFrame r;
+  r.conn = this;
+  r.reads = true;
+  r.buf = buf;
+  r.len = len;
+  r.got = -1;
+  return r;
+}
+
+bool CoroConn::RecvFrame::poll() {
+  // Input a stream buffered before it broke is still good, a datagram's is not.
+  if (conn->cancelled || (conn->datagram && conn->broken)) {
+    got = -1;
+    return true;
+  }
+  if (conn->datagram) {
+    if (!conn->readable) {
+      return false;
+    }
+    ssize_t n;
+    do {
+      n = recv(conn->sock, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn->readable = false;
+      return false;
+    }
+    if (n < 0) {
+      conn->broken = true;
+    }
+    got = n;
+    return true;
+  }
+  for (;;) {
+    if (conn->in.size() >= len) {
+      conn->in.copy((char *)buf, len);
+      conn->in.erase(0, len);
+      got = len;
+      return true;
+    }
+    if (conn->broken) {
+      got = -1;
+      return true;
+    }
+    size_t before = conn->in.size();
+    conn->fill();
+    if (conn->in.size() == before && !conn->broken) {
+      return false;
+    }
+  }
+}
+
+CoroConn::Peek CoroConn::peek() {
+  Peek r;
+  r.conn = this;
+  r.reads = true;
+  r.byte = -1;
+  return r;
+}
+
+bool CoroConn::Peek::poll() {
+  for (;;) {
+    if (conn->cancelled) {
+      byte = -1;
+      return true;
+    }
+    if (!conn->in.empty()) {
+      byte = (unsigned char)conn->in[0];
+      return true;
+    }
+    if (conn->broken) {
+      byte = -1;
+      return true;
+    }
+    conn->fill();
+    if (conn->in.empty() && !conn->broken) {
+      return false;
+    }
+  }
+}
+
+int CoroConn::peekNow() {
+  if (in.empty() && !failed()) {
+    readable = true; // Before the first EPOLLIN, see attach().
+    fill();
+  }
+  return in.empty() ? -1 : (unsigned char)in[0];
+}
+
+CoroConn::Send CoroConn::send(const void *data, size_t len) {
+  Send s;
+  s.conn = this;
+  s.reads = false;
+  s.limit = highWater;
+  if (failed()) {
+    return s;
+  }
+  if (datagram) {
+    // A datagram the socket does not take is lost, as it could be on the wire.
+    if (::send(sock, data, len, MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      broken = true;
+    }
+    return s;
+  }
+  const char *p = (const char *)data;
+  while (len > 0) {
+    if (outTail == NULL || outTail->end == sizeof(outTail->data)) {
+      CoroChunk *c = chunkAlloc();
+      if (c == NULL) {
+        broken = true; // Out of output memory, give this conn up rather than others.
+        return s;
+      }
+      if (outTail == NULL) {
+        outHead = c;
+      } else {
+        outTail->next = c;
+      }
+      outTail = c;
+    }
+    size_t part = sizeof(outTail->data) - outTail->end;
+    if (part > len) {
+      part = len;
+    }
+    memcpy(outTail->data + outTail->end, p, part);
+    outTail->end += part;
+    outBytes += part;
+    p += part;
+    len -= part;
+  }
+  // Above the high watermark wait for the low one, so a slow reader is not
+  // woken for every few bytes it takes.
+  s.limit = outBytes > highWater ? lowWater : highWater;
+  if (blocked) {
+    // Goes out with the rest on EPOLLOUT.
+  } else if (outbox == NULL) {
+    flushSome();
+  } else if (!inOutbox) {
+    outbox->dirty.push_back(this);
+    inOutbox = true;
+  }
+  return s;
+}
+
+CoroConn::Send CoroConn::sendLast(const void *data, size_t len) {
+  last = !datagram && !failed();
+  Send s = send(data, len);
+  s.limit = 0;
+  return s;
+}
+
+CoroConn::Send CoroConn::flush() {
+  Send s;
+  s.conn = this;
+  s.reads = false;
+  s.limit = 0;
+  return s;
+}
+
+bool CoroConn::Send::poll() {
+  return conn->failed() || conn->pending() <= limit;
+}
+
+bool CoroConn::Send::await_resume() const {
+  return !conn->failed();
+}
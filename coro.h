@@ -0,0 +1,262 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <coroutine>
+#include <exception>
+#include <queue>
+#include <string>
+#include <vector>
+
+/*
+   A small C++20 coroutine runtime for sessions on an epoll loop.
+
+   A session is a CoroTask coroutine that reads like a blocking handler:
+
+     CoroTask session(...) {
+       if (!co_await conn.send(hello, len)) co_return;
+       std::string line;
+       if (!co_await conn.recvLine(&line, MAX_LINE)) co_return;
+       ...
+     }
+
+   It starts at once, runs until the first operation that cannot complete,
+   and is resumed from the loop when its socket is ready. It frees itself when
+   it returns. Frames come from a per-thread pool (coroFrameAlloc()), so a
+   session costs one pooled frame, not a thread and no malloc once warm.
+
+   The owner of the loop registers each CoroConn under its own epoll tag and
+   passes the events to onEvents(). Every operation yields false (or -1) when
+   the connection fails or is cancelled, so a session always ends by running
+   to its end. Timeouts are cancel() calls from the owner's sweep, or a
+   CoroTimers sleep.
+
+   Everything is single threaded: a conn, its coroutine and the timers belong
+   to the thread that runs the loop.
+*/
+
+void *coroFrameAlloc(size_t size);
+void coroFrameFree(void *frame, size_t size);
+
+/*
+   Stream output is a chain of CORO_CHUNK_SIZE chunks from a per-thread pool,
+   recycled like the frames. At most <chunks> are out at once (0 = no limit,
+   the default): a send that needs one more fails its conn instead, so a
+   loop whose clients all stopped reading holds at most chunks *
+   CORO_CHUNK_SIZE bytes of output, however many there are.
+*/
+#define CORO_CHUNK_SIZE 512
+
+struct CoroOutputStats {
+  size_t chunks;    // In use now.
+  size_t peak;
+  uint64_t refused; // Sends failed because the pool was at its limit.
+};
+
+void coroSetOutputLimit(size_t chunks);
+CoroOutputStats coroOutputStats(); // Of the calling thread.
+
+/* Fire-and-forget coroutine, eager start, frame freed when it returns. */
+struct CoroTask {
+  struct promise_type {
+    CoroTask get_return_object() { return CoroTask(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    static void *operator new(size_t size) { return coroFrameAlloc(size); }
+    static void operator delete(void *frame, size_t size) { coroFrameFree(frame, size); }
+  };
+};
+
+uint64_t coroNow(); // CLOCK_MONOTONIC in nanoseconds.
+
+/* Sleeping coroutines, ordered by wake-up time. */
+class CoroTimers {
+public:
+  struct Sleep {
+    CoroTimers *timers;
+    uint64_t deadline;
+    bool await_ready() const { return deadline <= coroNow(); }
+    void await_suspend(std::coroutine_handle<> h) { timers->add(deadline, h); }
+    void await_resume() const {}
+  };
+
+  CoroTimers() : seq(0) {}
+  Sleep sleepUntil(uint64_t deadlineNs) { return Sleep{this, deadlineNs}; }
+  uint64_t next() const { return heap.empty() ? UINT64_MAX : heap.top().deadline; }
+  void run(uint64_t now); // Resume every sleeper that is due.
+
+private:
+  struct Entry {
+    uint64_t deadline;
+    uint64_t seq; // Ties wake in sleep order.
+    std::coroutine_handle<> handle;
+    bool operator>(const Entry &o) const {
+      return deadline != o.deadline ? deadline > o.deadline : seq > o.seq;
+    }
+  };
+  void add(uint64_t deadline, std::coroutine_handle<> h) { heap.push(Entry{deadline, seq++, h}); }
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > heap;
+  uint64_t seq;
+};
+
+/* Coroutines waiting for something another coroutine will announce. */
+class CoroSignal {
+public:
+  struct Wait {
+    CoroSignal *signal;
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h) { signal->waiters.push_back(h); }
+    void await_resume() const {}
+  };
+  Wait wait() { return Wait{this}; }
+  void notifyOne();
+
+private:
+  std::vector<std::coroutine_handle<> > waiters;
+};
+
+class CoroConn;
+struct CoroChunk;
+
+/*
+   Stream conns with output queued since the last flush(). The loop calls
+   flush() once per iteration, before it sleeps, so everything a session sent
+   while the loop handled one batch of events leaves in one system call and,
+   with TCP_NODELAY, as few segments as its size allows.
+*/
+class CoroOutbox {
+public:
+  void flush();
+
+private:
+  friend class CoroConn;
+  std::vector<CoroConn *> dirty;
+};
+
+/* Base of the conn operations: poll() tries to finish, true once it has. */
+struct CoroOp {
+  CoroConn *conn;
+  bool reads; // Needs EPOLLIN while it waits.
+  virtual bool poll() = 0;
+  void await_suspend(std::coroutine_handle<> h);
+};
+
+/*
+   One socket driven by one coroutine at a time. A stream conn buffers input
+   and output; a datagram conn reads and writes whole datagrams. Stream output
+   waits for the outbox flush (or is written at once without an outbox), what
+   the socket does not take is flushed on EPOLLOUT. A send() that leaves more
+   than <highWater> bytes unsent completes only once at most <lowWater> are
+   left, so a session that writes faster than its peer reads stops, and
+   stops reading, until its peer has caught up. blockedSince() tells the
+   owner how long the peer has not taken any output, to drop slow readers.
+
+   The conn owns the only descriptor of its socket, so close() alone takes it
+   out of epoll.
+*/
+class CoroConn {
+public:
+  CoroConn();
+  ~CoroConn() { close(); }
+
+  /* Take <fd> (non-blocking) and add it to <epfd> with data.ptr = <tag>.
+     Stream output is batched in <outbox> if there is one. */
+  void attach(int epfd, int fd, void *tag, bool datagram, CoroOutbox *outbox = NULL);
+  void close();   // Remove from epoll and close; pending output is dropped.
+  void cancel();  // Fail the current and every later operation.
+  void onEvents(uint32_t events);
+
+  struct RecvLine : CoroOp {
+    std::string *line;
+    size_t maxLen;
+    bool ok;
+    bool poll() override;
+    bool await_ready() { return poll(); }
+    bool await_resume() const { return ok; }
+  };
+  struct RecvFrame : CoroOp {
+    void *buf;
+    size_t len;
+    ssize_t got;
+    bool poll() override;
+    bool await_ready() { return poll(); }
+    ssize_t await_resume() const { return got; }
+  };
+  struct Peek : CoroOp {
+    int byte;
+    bool poll() override;
+    bool await_ready() { return poll(); }
+    int await_resume() const { return byte; }
+  };
+  struct Send : CoroOp {
+    size_t limit;
+    bool poll() override;
+    bool await_ready() { return poll(); }
+    bool await_resume() const;
+  };
+
+  /* One "\n"-terminated line, without the "\n" (and "\r"). On a datagram
+     conn the next datagram must be exactly one such line. */
+  RecvLine recvLine(std::string *line, size_t maxLen);
+  /* Stream: exactly <len> bytes. Datagram: one datagram of at most <len>.
+     Yields the size, or -1. */
+  RecvFrame recvFrame(void *buf, size_t len);
+  /* Stream: the next input byte, left in the buffer. Yields it, or -1. */
+  Peek peek();
+  /* Stream: the next input byte after at most one read, -1 if none has
+     arrived yet. Never waits; for a session that starts differently when its
+     client spoke first. */
+  int peekNow();
+  /* Queue <len> bytes. */
+  Send send(const void *data, size_t len);
+  /* Queue the last bytes of a stream and wait until they are written, with
+     the FIN in the same segment (MSG_MORE, then shutdown(SHUT_WR)). */
+  Send sendLast(const void *data, size_t len);
+  /* Wait until everything queued has been written. */
+  Send flush();
+
+  int fd() const { return sock; }
+  bool failed() const { return broken || cancelled; }
+  bool wasCancelled() const { return cancelled; }
+  size_t pending() const { return outBytes; }
+  /* Since when the socket has taken no output although some is pending, 0
+     while it takes everything. */
+  uint64_t blockedSince() const { return blockedAt; }
+  unsigned writes() const { return writeCalls; } // Write system calls so far.
+
+  size_t highWater; // See send().
+  size_t lowWater;
+
+private:
+  friend struct CoroOp;
+  friend class CoroOutbox;
+  void fill();       // Read what the socket has into <in>.
+  void flushSome();  // Write what the socket takes of the output chain.
+  void dropOutput(); // Give the chain back to the pool.
+  void progress();   // Resume the coroutine if its operation is done.
+  void updateInterest(bool keepInput);
+  void park(CoroOp *op, std::coroutine_handle<> h);
+
+  int epfd;
+  int sock;
+  void *tag;
+  bool datagram;
+  bool broken;    // Error or EOF on the socket.
+  bool readable;  // Reading may find data; cleared when it did not, set by EPOLLIN.
+  bool blocked;   // The socket did not take all output, wait for EPOLLOUT.
+  bool last;      // <out> ends the stream, shut it down once written.
+  bool cancelled;
+  uint32_t interest;
+  std::string in;
+  CoroChunk *outHead; // Unsent output, oldest first.
+  CoroChunk *outTail;
+  size_t outBytes;
+  uint64_t blockedAt;
+  unsigned writeCalls;
+  CoroOutbox *outbox;
+  bool inOutbox;
+  CoroOp *op;     // What the coroutine waits for, NULL if it is not waiting.
+  std::coroutine_handle<> waiter;
+};
@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+/*
+   libFuzzer harness (make fuzz) for the binary decoders of codec.h. Any input
+   of the right size decodes, and encoding the fields gives the same bytes
+   back; any other size is refused.
+*/
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  ProtocolFields p;
+  bool decoded = decodeProtocol(data, size, &p);
+  if (decoded != (size == sizeof(calcProtocol))) {
+    abort();
+  }
+  if (decoded) {
+    calcProtocol again = encodeProtocol(p);
+    if (memcmp(&again, data, sizeof(again)) != 0) {
+      abort();
+    }
+  }
+
+  MessageFields m;
+  decoded = decodeMessage(data, size, &m);
+  if (decoded != (size == sizeof(calcMessage))) {
+    abort();
+  }
+  if (decoded) {
+    calcMessage again = encodeMessage(m);
+    if (memcmp(&again, data, sizeof(again)) != 0) {
+      abort();
+    }
+  }
+  return 0;
+}
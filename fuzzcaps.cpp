@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+/*
+   libFuzzer harness (make fuzz) for the capability parsing of codec.h: the
+   input as a protocol list, each line through parseCapsLine() the way the
+   client reads it, and as a resume frame, which must encode back to the same
+   bytes.
+*/
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  const char *p = (const char *)data;
+  const char *end = p + size;
+  ProtocolCaps caps;
+  memset(&caps, 0, sizeof(caps));
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    size_t len = (eol != NULL ? eol : end) - p;
+    parseCapsLine(p, len, &caps);
+    p += len + (eol != NULL);
+  }
+  // A ticket only ever comes with the resume capability.
+  if (caps.ticket != 0 && !(caps.caps & CAPS_RESUME)) {
+    abort();
+  }
+
+  uint32_t choice;
+  uint64_t ticket;
+  if (decodeResume(data, size, &choice, &ticket)) {
+    char frame[CAPS_RESUME_LEN];
+    encodeResume(frame, choice, ticket);
+    if (size != CAPS_RESUME_LEN || memcmp(frame, data, sizeof(frame)) != 0) {
+      abort();
+    }
+  }
+  return 0;
+}
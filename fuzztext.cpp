@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+/*
+   libFuzzer harness (make fuzz) for the text parsers of codec.h. The input is
+   one line as a client sends it, in a buffer of exactly its size, so ASan
+   catches any read past <len>. Whatever parses must print back to a line that
+   parses to the same values.
+*/
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  const char *line = (const char *)data;
+  char again[64];
+
+  TextAssignment t;
+  if (parseTextAssignment(line, size, &t)) {
+    if (t.nameLen == 0 || t.name < line || t.name + t.nameLen > line + size) {
+      abort();
+    }
+    if (t.op != NULL) {
+      if (t.nameLen != strlen(t.op->name) || memcmp(t.name, t.op->name, t.nameLen) != 0) {
+        abort();
+      }
+      TextAssignment u;
+      int n = snprintf(again, sizeof(again), "%s %d %d\n", t.op->name, t.value1, t.value2);
+      if (!parseTextAssignment(again, n, &u) || u.op != t.op || u.value1 != t.value1 || u.value2 != t.value2) {
+        abort();
+      }
+    }
+  }
+
+  int32_t value;
+  if (parseTextAnswer(line, size, &value)) {
+    int32_t same;
+    int n = snprintf(again, sizeof(again), "%d\n", value);
+    if (!parseTextAnswer(again, n, &same) || same != value) {
+      abort();
+    }
+  }
+  return 0;
+}
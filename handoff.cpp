@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+static const volatile sig_atomic_t *stopFlag = NULL;
+
+static bool interrupted(void) {
+  return errno == EINTR && (stopFlag == NULL || !*stopFlag);
+}
+
+static bool fillAddress(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "handoff: path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+int handoffListen(const char *path) {
+  struct sockaddr_un addr;
+  if (!fillAddress(path, &addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    perror("handoff");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int handoffConnect(const char *path) {
+  struct sockaddr_un addr;
+  if (!fillAddress(path, &addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool handoffSendFds(int sock, const int *fds, int count, const void *data, size_t len) {
+  if (count > HANDOFF_MAX_FDS || len == 0) {
+    return false;
+  }
+  struct msghdr msg;
+  struct iovec iov;
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (count > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  }
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && interrupted());
+  if (n < 0) {
+    return false;
+  }
+  // The descriptors went with the first byte, the rest is plain data.
+  return handoffWriteAll(sock, (const char *)data + n, len - n);
+}
+
+int handoffRecvFds(int sock, int *fds, int maxFds, void *data, size_t len) {
+  struct msghdr msg;
+  struct iovec iov;
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && interrupted());
+  if (n <= 0) {
+    return -1;
+  }
+  int count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *incoming = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < received; i++) {
+      if (count < maxFds) {
+        fds[count++] = incoming[i];
+      } else {
+        close(incoming[i]);
+      }
+    }
+  }
+  if ((msg.msg_flags & MSG_CTRUNC) || !handoffReadAll(sock, (char *)data + n, len - n)) {
+    for (int i = 0; i < count; i++) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return count;
+}
+
+bool handoffWriteAll(int sock, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (interrupted()) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool handoffReadAll(int sock, void *data, size_t len) {
+  char *p = (char *)data;
+  while (len > 0) {
+    ssize_t n = recv(sock, p, len, 0);
+    if (n < 0 && interrupted()) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool handoffSetTimeout(int sock, int ms) {
+  struct timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+void handoffStopOn(const volatile sig_atomic_t *stop) {
+  stopFlag = stop;
+}
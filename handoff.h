@@ -0,0 +1,36 @@
+#pragma once
+#include <signal.h>
+#include <stddef.h>
+
+/*
+   Unix domain socket helpers for hot restart.
+
+   The running server listens on a filesystem path; a new server connects to it
+   and receives the listening sockets as SCM_RIGHTS ancillary data, followed by
+   whatever state the old process wants to pass on. All calls are blocking and
+   are only used from the main thread, outside the worker event loops; the
+   shared-memory transport reuses them for its short, bounded channel setup.
+*/
+
+#define HANDOFF_MAX_FDS 256
+
+int handoffListen(const char *path);  // Bind and listen, replacing a stale socket file.
+int handoffConnect(const char *path); // Connect to a running server.
+
+/* Send <len> bytes of <data> with <count> file descriptors attached. */
+bool handoffSendFds(int sock, const int *fds, int count, const void *data, size_t len);
+
+/* Receive exactly <len> bytes into <data>, and up to <maxFds> descriptors that
+   came with them. Returns the number of descriptors, or -1 on error. */
+int handoffRecvFds(int sock, int *fds, int maxFds, void *data, size_t len);
+
+bool handoffWriteAll(int sock, const void *data, size_t len);
+bool handoffReadAll(int sock, void *data, size_t len);
+
+/* Fail sends and receives on <sock> that block longer than <ms>, so a stuck
+   peer cannot hold the caller. */
+bool handoffSetTimeout(int sock, int ms);
+
+/* Calls interrupted by a signal are retried, unless <*stop> is set by then:
+   a stop request then fails the call instead of waiting for the peer. */
+void handoffStopOn(const volatile sig_atomic_t *stop);
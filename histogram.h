@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/*
+   HDR-style latency histogram: values are recorded with 3 significant digits
+   (2048 linear sub-buckets per power of two) from 1 up to 2^40, so a value in
+   nanoseconds can be anything from 1 ns to about 18 minutes. Recording is a
+   couple of shifts and an increment, and two histograms are merged by adding
+   their counts, so every load generator thread keeps its own and they are
+   combined once at the end.
+
+   Quantiles return the highest value that is equivalent to the recorded ones,
+   i.e. they never under-report.
+*/
+
+#define HISTOGRAM_SUB_BITS 11  // 2048 sub-buckets, 3 significant digits.
+#define HISTOGRAM_MAX_BITS 40  // Largest trackable value is 2^40 - 1.
+
+class Histogram {
+public:
+  Histogram()
+    : counts((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1), 0),
+      total(0), minValue(UINT64_MAX), maxValue(0), sum(0) {}
+
+  void record(uint64_t value) {
+    if (value >> HISTOGRAM_MAX_BITS) {
+      value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    counts[indexOf(value)]++;
+    total++;
+    sum += value;
+    if (value < minValue) minValue = value;
+    if (value > maxValue) maxValue = value;
+  }
+
+  void merge(const Histogram &o) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += o.counts[i];
+    }
+    total += o.total;
+    sum += o.sum;
+    if (o.minValue < minValue) minValue = o.minValue;
+    if (o.maxValue > maxValue) maxValue = o.maxValue;
+  }
+
+  /* Value at quantile <q> in [0, 1], 0 if the histogram is empty. */
+  uint64_t quantile(double q) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        uint64_t v = highestEquivalent(i);
+        return v < maxValue ? v : maxValue;
+      }
+    }
+    return maxValue;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? minValue : 0; }
+  uint64_t max() const { return maxValue; }
+  double mean() const { return total ? (double)sum / total : 0; }
+
+private:
+  static size_t indexOf(uint64_t value) {
+    const uint64_t subMask = (1ULL << HISTOGRAM_SUB_BITS) - 1;
+    const int half = HISTOGRAM_SUB_BITS - 1;
+    int bucket = (64 - __builtin_clzll(value | subMask)) - HISTOGRAM_SUB_BITS;
+    uint64_t sub = value >> bucket;
+    return ((size_t)(bucket + 1) << half) + (sub - (1ULL << half));
+  }
+
+  static uint64_t highestEquivalent(size_t index) {
+    const int half = HISTOGRAM_SUB_BITS - 1;
+    int bucket = (int)(index >> half) - 1;
+    uint64_t sub = (index & ((1ULL << half) - 1)) + (1ULL << half);
+    if (bucket < 0) {
+      sub -= 1ULL << half;
+      bucket = 0;
+    }
+    return (sub << bucket) + (1ULL << bucket) - 1;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t minValue;
+  uint64_t maxValue;
+  uint64_t sum;
+};
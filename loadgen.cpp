@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <string>
+#include <thread>
+
+#include "protocol.h"
+#include "codec.h"
+#include "loadgen.h"
+#include "coro.h"
+
+#define LOAD_EVENTS 256
+#define LOAD_MAX_LINE 256
+
+#define LOAD_MAX_LIST 16 // Lines in the server's protocol list.
+
+enum LoadOutcome { OUTCOME_OK, OUTCOME_FAILED, OUTCOME_TIMEOUT };
+
+/* Lives in the frame of its session coroutine; the epoll tag is its address. */
+struct LoadSession {
+  CoroConn conn;
+  uint64_t intended; // When the schedule wanted this session to start.
+  uint64_t deadline;
+  size_t slot;       // Position in LoadThread::active.
+};
+
+static uint64_t monotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+class LoadThread {
+public:
+  LoadThread(const LoadConfig &config, int threadIndex, uint64_t startNs, LoadResult *out)
+    : cfg(config), index(threadIndex), start(startNs), result(out), epfd(-1), lastDone(startNs),
+      scheduling(false) {
+    caps.caps = 0;
+    caps.ticket = 0;
+  }
+
+  void run() {
+    if (cfg.pin) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      perror("epoll_create1");
+      return;
+    }
+    struct epoll_event events[LOAD_EVENTS];
+    schedule();
+    for (;;) {
+      uint64_t now = monotonicNs();
+      timers.run(now);
+      if (active.size() < (size_t)cfg.maxInFlight) {
+        slotFree.notifyOne();
+      }
+      if (!scheduling && active.empty()) {
+        break;
+      }
+      outbox.flush();
+      // Sleep until the next start is due, or at most 1 ms for the timeouts.
+      uint64_t wake = now + 1000000ULL;
+      if (timers.next() < wake) {
+        wake = timers.next();
+      }
+      int n = waitUntil(events, wake);
+      for (int i = 0; i < n; i++) {
+        ((LoadSession *)events[i].data.ptr)->conn.onEvents(events[i].events);
+      }
+      expire(monotonicNs());
+    }
+    result->elapsed = (double)(lastDone - start) / 1e9;
+    close(epfd);
+  }
+
+private:
+  /* epoll_wait() with a nanosecond deadline, where the kernel supports it. */
+  int waitUntil(struct epoll_event *events, uint64_t wake) {
+    uint64_t now = monotonicNs();
+    uint64_t delay = wake > now ? wake - now : 0;
+    struct timespec ts;
+    ts.tv_sec = delay / 1000000000ULL;
+    ts.tv_nsec = delay % 1000000000ULL;
+    int n = epoll_pwait2(epfd, events, LOAD_EVENTS, &ts, NULL);
+    if (n < 0 && errno == ENOSYS) {
+      n = epoll_wait(epfd, events, LOAD_EVENTS, (int)((delay + 999999) / 1000000));
+    }
+    return n < 0 ? 0 : n;
+  }
+
+  /* Start sessions on time, or as soon as a slot is free when all are busy. */
+  CoroTask schedule() {
+    scheduling = true;
+    // Thread i owns slots i, i + threads, i + 2 * threads, ... of one global schedule.
+    double spacing = 1e9 / cfg.rate;
+    uint64_t end = start + (uint64_t)(cfg.duration * 1e9);
+    uint64_t giveUp = end + (uint64_t)cfg.timeoutMs * 1000000ULL;
+    uint64_t slot = index;
+    uint64_t next = start + (uint64_t)(slot * spacing);
+    for (; next < end; slot += cfg.threads, next = start + (uint64_t)(slot * spacing)) {
+      co_await timers.sleepUntil(next);
+      while (active.size() >= (size_t)cfg.maxInFlight) {
+        co_await slotFree.wait();
+      }
+      if (monotonicNs() >= giveUp) {
+        break;
+      }
+      startSession(next);
+    }
+    // Sessions that never got a socket were late by at least this much.
+    uint64_t now = monotonicNs();
+    for (; next < end; slot += cfg.threads, next = start + (uint64_t)(slot * spacing)) {
+      result->unsent++;
+      result->latency.record(now - next);
+    }
+    scheduling = false;
+  }
+
+  void startSession(uint64_t intended) {
+    result->started++;
+    bool tcp = cfg.transport == LOAD_TCP;
+    int fd = socket(cfg.addr.ss_family, (tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      result->failed++;
+      return;
+    }
+    if (tcp) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    // A TCP connect that fails later shows up as EPOLLERR on the first read.
+    if (connect(fd, (const struct sockaddr *)&cfg.addr, cfg.addrLen) < 0 && errno != EINPROGRESS) {
+      close(fd);
+      result->failed++;
+      return;
+    }
+    session(fd, intended);
+  }
+
+  /* One session, from the protocol list or hello to the verdict. */
+  CoroTask session(int fd, uint64_t intended) {
+    LoadSession s;
+    s.intended = intended;
+    s.deadline = monotonicNs() + (uint64_t)cfg.timeoutMs * 1000000ULL;
+    s.slot = active.size();
+    active.push_back(&s);
+    s.conn.attach(epfd, fd, &s, cfg.transport == LOAD_UDP, &outbox);
+
+    bool text = cfg.api == LOAD_TEXT;
+    bool ok = false;
+    std::string line;
+    do {
+      if (cfg.transport == LOAD_TCP) {
+        uint32_t want = text ? CAPS_TEXT_TCP : CAPS_BINARY_TCP;
+        int verdict = -1; // CAPS_ACK or CAPS_NAK, once the server answered a resume frame
+        bool resuming = !cfg.legacyHandshake && (caps.caps & want) && (caps.caps & CAPS_RESUME);
+        if (resuming) {
+          char frame[CAPS_RESUME_LEN];
+          encodeResume(frame, want, caps.ticket);
+          if (!co_await s.conn.send(frame, sizeof(frame))) {
+            break;
+          }
+          verdict = co_await s.conn.peek();
+          if (verdict == CAPS_ACK || verdict == CAPS_NAK) {
+            co_await s.conn.recvFrame(frame, 1);
+          } else {
+            verdict = -1; // The list came first, the answer follows it.
+          }
+        }
+        if (verdict != CAPS_ACK) {
+          ProtocolCaps offered = {0, 0};
+          bool listed = false;
+          for (int i = 0; i < LOAD_MAX_LIST && !listed; i++) {
+            if (!co_await s.conn.recvLine(&line, LOAD_MAX_LINE)) {
+              break;
+            }
+            listed = line.empty();
+            parseCapsLine(line.data(), line.size(), &offered);
+          }
+          if (resuming && verdict < 0) {
+            char answer;
+            verdict = co_await s.conn.recvFrame(&answer, 1) == 1 ? (unsigned char)answer : -1;
+          }
+          caps = offered; // A refused ticket is replaced or forgotten.
+          const char *choice = text ? "TEXT TCP 1.1 OK\n" : "BINARY TCP 1.1 OK\n";
+          if (!listed || (verdict != CAPS_ACK && (!(offered.caps & want) ||
+                                                  !co_await s.conn.send(choice, strlen(choice))))) {
+            break;
+          }
+        }
+      } else if (text) {
+        if (!co_await s.conn.send("TEXT UDP 1.1\n", 13)) {
+          break;
+        }
+      } else {
+        MessageFields hello = {22, 0, 17, 1, 0};
+        calcMessage m = encodeMessage(hello);
+        if (!co_await s.conn.send(&m, sizeof(m))) {
+          break;
+        }
+      }
+
+      int32_t r;
+      if (text) {
+        TextAssignment t;
+        char answer[32];
+        if (!co_await s.conn.recvLine(&line, LOAD_MAX_LINE) || !parseTextAssignment(line.data(), line.size(), &t) ||
+            !opSolve(t.op, t.value1, t.value2, &r)) {
+          break;
+        }
+        int len = snprintf(answer, sizeof(answer), "%d\n", r);
+        if (!co_await s.conn.send(answer, len) || !co_await s.conn.recvLine(&line, LOAD_MAX_LINE)) {
+          break;
+        }
+        ok = line == "OK";
+      } else {
+        // A UDP server says no with a short calcMessage instead.
+        char frame[sizeof(calcProtocol)];
+        ProtocolFields f;
+        ssize_t got = co_await s.conn.recvFrame(frame, sizeof(frame));
+        if (got < 0 || !decodeProtocol(frame, got, &f) || f.type != 1 ||
+            !opSolve(opByCode(f.arith), f.value1, f.value2, &r)) {
+          break;
+        }
+        f.type = 2;
+        f.result = r;
+        calcProtocol p = encodeProtocol(f);
+        MessageFields m;
+        if (!co_await s.conn.send(&p, sizeof(p))) {
+          break;
+        }
+        got = co_await s.conn.recvFrame(frame, sizeof(calcMessage));
+        if (got < 0 || !decodeMessage(frame, got, &m)) {
+          break;
+        }
+        ok = m.type == 2 && m.message == 1;
+      }
+    } while (false);
+
+    finish(&s, ok ? OUTCOME_OK : s.conn.wasCancelled() ? OUTCOME_TIMEOUT : OUTCOME_FAILED);
+  }
+
+  void finish(LoadSession *s, LoadOutcome outcome) {
+    uint64_t now = monotonicNs();
+    if (outcome == OUTCOME_OK) {
+      result->completed++;
+      result->latency.record(now - s->intended);
+    } else if (outcome == OUTCOME_TIMEOUT) {
+      // A lower bound like an unsent session; left out, a stall would lower p99.
+      result->timeouts++;
+      result->latency.record(now - s->intended);
+    } else {
+      result->failed++;
+    }
+    lastDone = now;
+    s->conn.close();
+    active[s->slot] = active.back();
+    active[s->slot]->slot = s->slot;
+    active.pop_back();
+  }
+
+  void expire(uint64_t now) {
+    for (size_t i = 0; i < active.size();) {
+      if (active[i]->deadline < now) {
+        active[i]->conn.cancel(); // Finishes the session, which moves the last one into slot i.
+      } else {
+        i++;
+      }
+    }
+  }
+
+  const LoadConfig &cfg;
+  int index;
+  uint64_t start;
+  LoadResult *result;
+  int epfd;
+  uint64_t lastDone;
+  bool scheduling; // schedule() has not started every session yet.
+  ProtocolCaps caps; // What the server offered in the last protocol list.
+  CoroTimers timers;
+  CoroSignal slotFree;
+  CoroOutbox outbox;
+  std::vector<LoadSession *> active;
+};
+
+static void clearCounts(const LoadConfig &cfg, LoadResult *r) {
+  r->transport = cfg.transport;
+  r->api = cfg.api;
+  r->rate = cfg.rate;
+  r->threads = cfg.threads;
+  r->maxInFlight = cfg.maxInFlight;
+  r->elapsed = 0;
+  r->started = r->completed = r->failed = r->timeouts = r->unsent = 0;
+}
+
+bool loadRun(const LoadConfig &cfg, LoadResult *result) {
+  if (cfg.rate <= 0 || cfg.threads < 1 || cfg.maxInFlight < 1 || cfg.duration <= 0) {
+    return false;
+  }
+  std::vector<LoadResult> perThread(cfg.threads);
+  std::vector<LoadThread *> workers;
+  std::vector<std::thread> threads;
+  // A common start a little in the future, so no thread begins behind schedule.
+  uint64_t start = monotonicNs() + 20000000ULL;
+  for (int i = 0; i < cfg.threads; i++) {
+    clearCounts(cfg, &perThread[i]);
+    workers.push_back(new LoadThread(cfg, i, start, &perThread[i]));
+  }
+  for (int i = 0; i < cfg.threads; i++) {
+    threads.push_back(std::thread(&LoadThread::run, workers[i]));
+  }
+
+  clearCounts(cfg, result);
+  result->latency = Histogram();
+  for (int i = 0; i < cfg.threads; i++) {
+    threads[i].join();
+    delete workers[i];
+    result->started += perThread[i].started;
+    result->completed += perThread[i].completed;
+    result->failed += perThread[i].failed;
+    result->timeouts += perThread[i].timeouts;
+    result->unsent += perThread[i].unsent;
+    if (perThread[i].elapsed > result->elapsed) {
+      result->elapsed = perThread[i].elapsed;
+    }
+    result->latency.merge(perThread[i].latency);
+  }
+  return true;
+}
+
+const char *loadTransportName(LoadTransport transport) {
+  return transport == LOAD_TCP ? "TCP" : "UDP";
+}
+
+const char *loadApiName(LoadApi api) {
+  return api == LOAD_TEXT ? "text" : "binary";
+}
+
+bool loadWriteJson(const char *path, const std::vector<LoadResult> &results) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  fprintf(f, "{\"results\":[");
+  for (size_t i = 0; i < results.size(); i++) {
+    const LoadResult &r = results[i];
+    const Histogram &h = r.latency;
+    fprintf(f, "%s\n {\"transport\":\"%s\",\"api\":\"%s\",\"target_rate\":%.1f,\"threads\":%d,"
+            "\"max_in_flight\":%d,\"elapsed_s\":%.3f,\"started\":%llu,\"completed\":%llu,"
+            "\"failed\":%llu,\"timeouts\":%llu,\"unsent\":%llu,\"achieved_rate\":%.1f,\n"
+            "  \"latency_us\":{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+            "\"p99.9\":%.3f,\"p99.99\":%.3f,\"max\":%.3f}}",
+            i == 0 ? "" : ",", loadTransportName(r.transport), loadApiName(r.api), r.rate,
+            r.threads, r.maxInFlight, r.elapsed, (unsigned long long)r.started,
+            (unsigned long long)r.completed, (unsigned long long)r.failed,
+            (unsigned long long)r.timeouts, (unsigned long long)r.unsent,
+            r.elapsed > 0 ? r.completed / r.elapsed : 0.0,
+            h.min() / 1e3, h.mean() / 1e3, h.quantile(0.50) / 1e3, h.quantile(0.90) / 1e3,
+            h.quantile(0.99) / 1e3, h.quantile(0.999) / 1e3, h.quantile(0.9999) / 1e3, h.max() / 1e3);
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+bool loadWriteCsv(const char *path, const std::vector<LoadResult> &results) {
+  static const double percentiles[] = {
+    0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 99, 99.5, 99.9, 99.95, 99.99, 99.999, 100
+  };
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  fprintf(f, "transport,api,target_rate,threads,percentile,latency_us\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const LoadResult &r = results[i];
+    for (size_t j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]); j++) {
+      fprintf(f, "%s,%s,%.1f,%d,%g,%.3f\n", loadTransportName(r.transport), loadApiName(r.api),
+              r.rate, r.threads, percentiles[j], r.latency.quantile(percentiles[j] / 100) / 1e3);
+    }
+  }
+  return fclose(f) == 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <sys/socket.h>
+
+#include "histogram.h"
+
+/*
+   Open-loop load generator for the calculator protocol.
+
+   Sessions are started on a fixed schedule, <rate> per second spread evenly
+   over the threads, whatever the server does. Each session's latency runs
+   from the time the schedule wanted it to start, not from when a socket was
+   free to start it. A server stall therefore shows up as latency in every
+   session that should have started during the stall; it is not hidden by
+   fewer sessions being sent (coordinated omission).
+
+   Every thread is pinned to its own core and drives up to <maxInFlight>
+   non-blocking sessions from one epoll loop. When all of them are busy,
+   due sessions queue up and their wait counts as latency. A session that
+   times out counts with the time it waited, so the percentiles cover every
+   session but the failed ones.
+
+   A TCP thread keeps the resume ticket (codec.h) of the server's first
+   protocol list, so its later sessions skip the list like returning
+   clients do; legacyHandshake measures the list every time.
+*/
+
+enum LoadTransport { LOAD_TCP, LOAD_UDP };
+enum LoadApi { LOAD_TEXT, LOAD_BINARY };
+
+struct LoadConfig {
+  LoadTransport transport;
+  LoadApi api;
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  double rate;       // Sessions per second, all threads together.
+  int threads;
+  int maxInFlight;   // Concurrent sessions per thread.
+  double duration;   // Seconds of scheduled sessions.
+  int timeoutMs;     // A session not done by then counts as timed out.
+  bool pin;          // Pin thread i to CPU i modulo the CPU count.
+  bool legacyHandshake; // TCP: always read the protocol list, never resume.
+};
+
+struct LoadResult {
+  LoadTransport transport;
+  LoadApi api;
+  double rate;
+  int threads;
+  int maxInFlight;
+  double elapsed;      // Seconds from the first scheduled start to the last completion.
+  uint64_t started;
+  uint64_t completed;  // Got an OK from the server.
+  uint64_t failed;     // Rejected, ERROR, or broken connection.
+  uint64_t timeouts;
+  uint64_t unsent;     // Scheduled but never started, all sessions were busy.
+  Histogram latency;   // Nanoseconds from the scheduled start of every completed,
+                       // timed-out or unsent session, a lower bound for the last
+                       // two. Failed sessions are not in it.
+};
+
+/* Run one load test, blocking until all threads are done. */
+bool loadRun(const LoadConfig &cfg, LoadResult *result);
+
+const char *loadTransportName(LoadTransport transport);
+const char *loadApiName(LoadApi api);
+
+/* One JSON document with a summary per result. */
+bool loadWriteJson(const char *path, const std::vector<LoadResult> &results);
+
+/* The latency percentile spectrum of every result, one row per percentile. */
+bool loadWriteCsv(const char *path, const std::vector<LoadResult> &results);
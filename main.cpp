@@ -1,11 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 /* Include the calcLib header file, using <> as its a library and not just a object file we link.  */
 #include <calcLib.h>
 
+#include "protocol.h"
+#include "codec.h"
 
 
 /* 
@@ -22,18 +34,666 @@
 
 
 
+/*
+   Batch mode: test --batch [--binary] [--threads N] [--out FILE] [FILE]
+
+   Solves a whole log of assignments offline. Text input is one "op a b" line
+   per assignment and gives one result line ("42" or "ERROR"); binary input is
+   a stream of calcProtocol records (type 1) and gives the same records back
+   as answers (type 2, inResult set), or with type 0 if they cannot be solved.
+   In both cases that is what a client would send the server.
+
+   A file is memory mapped, stdin (or "-") is read in blocks. Every block is
+   cut at record boundaries into one chunk per thread; a thread parses its
+   chunk into arrays of BATCH_LANES assignments and solves them together with
+   opSolveLanes() (operators.h), so add/sub/mul compile to vector blends and
+   only div takes a scalar pass.
+   Counts and throughput go to stderr.
+*/
+
+#define BATCH_BLOCK (64 << 20) /* Input bytes per parallel round. */
+#define BATCH_LANES 1024       /* Assignments solved together. */
+#define BATCH_MAX_THREADS 256
+
+struct batchChunk {
+  const char *in;
+  size_t len;
+  int binary;
+  char *out;
+  size_t outLen;
+  size_t outCap;
+  unsigned long count;
+  unsigned long errors;
+};
+
+static void batchReserve(struct batchChunk *c, size_t more){
+  if (c->outLen + more <= c->outCap) {
+    return;
+  }
+  size_t cap = c->outCap * 2 > c->outLen + more ? c->outCap * 2 : c->outLen + more;
+  c->out = (char *)realloc(c->out, cap);
+  if (c->out == NULL) {
+    perror("batch");
+    exit(1);
+  }
+  c->outCap = cap;
+}
+
+/* Append "value\n", or "ERROR\n". */
+static char *batchFormat(char *out, int32_t value, int ok){
+  if (!ok) {
+    memcpy(out, "ERROR\n", 6);
+    return out + 6;
+  }
+  char digits[12];
+  int n = 0;
+  uint32_t u = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (value < 0) {
+    *out++ = '-';
+  }
+  while (n > 0) {
+    *out++ = digits[--n];
+  }
+  *out++ = '\n';
+  return out;
+}
+
+static void *batchWorker(void *arg){
+  struct batchChunk *c = (struct batchChunk *)arg;
+  static __thread int32_t arith[BATCH_LANES], a[BATCH_LANES], b[BATCH_LANES], r[BATCH_LANES];
+  static __thread unsigned char ok[BATCH_LANES];
+  const size_t recordSize = sizeof(struct calcProtocol);
+  const char *p = c->in;
+  const char *end = c->in + c->len;
+
+  if (c->binary) {
+    size_t records = c->len / recordSize;
+    batchReserve(c, records * recordSize);
+    for (size_t first = 0; first < records; first += BATCH_LANES) {
+      int n = records - first < BATCH_LANES ? (int)(records - first) : BATCH_LANES;
+      const char *in = c->in + first * recordSize;
+      for (int i = 0; i < n; i++) {
+        ProtocolFields f;
+        decodeProtocol(in + i * recordSize, recordSize, &f);
+        arith[i] = (int32_t)f.arith;
+        a[i] = f.value1;
+        b[i] = f.value2;
+        ok[i] = f.type == 1;
+      }
+      opSolveLanes(arith, a, b, r, ok, n);
+      char *out = c->out + c->outLen;
+      for (int i = 0; i < n; i++) {
+        ProtocolFields f;
+        decodeProtocol(in + i * recordSize, recordSize, &f);
+        f.type = ok[i] ? 2 : 0;
+        f.result = ok[i] ? r[i] : 0;
+        struct calcProtocol m = encodeProtocol(f);
+        memcpy(out + i * recordSize, &m, recordSize);
+        c->errors += !ok[i];
+      }
+      c->outLen += n * recordSize;
+      c->count += n;
+    }
+    return NULL;
+  }
+
+  while (p < end) {
+    int n = 0;
+    while (n < BATCH_LANES && p < end) {
+      const char *eol = (const char *)memchr(p, '\n', end - p);
+      const char *lineEnd = eol != NULL ? eol : end;
+      const char *q = p;
+      while (q < lineEnd && textBlank(*q)) q++;
+      if (q == lineEnd) {
+        p = lineEnd + 1; /* Blank line, no assignment. */
+        continue;
+      }
+      struct TextAssignment t;
+      ok[n] = parseTextAssignment(p, lineEnd - p, &t);
+      arith[n] = ok[n] && t.op != NULL ? (int32_t)t.op->code : 0;
+      a[n] = ok[n] ? t.value1 : 0;
+      b[n] = ok[n] ? t.value2 : 0;
+      n++;
+      p = lineEnd + 1;
+    }
+    opSolveLanes(arith, a, b, r, ok, n);
+    batchReserve(c, (size_t)n * 12);
+    char *out = c->out + c->outLen;
+    for (int i = 0; i < n; i++) {
+      out = batchFormat(out, r[i], ok[i]);
+      c->errors += !ok[i];
+    }
+    c->outLen = out - c->out;
+    c->count += n;
+  }
+  return NULL;
+}
+
+static int batchWriteAll(int fd, const char *p, size_t len){
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Length of the part of [p, p+len) that ends on a record boundary. */
+static size_t batchCut(const char *p, size_t len, int binary, int final){
+  if (binary) {
+    return len - len % sizeof(struct calcProtocol);
+  }
+  if (final) {
+    return len;
+  }
+  const char *nl = (const char *)memrchr(p, '\n', len);
+  return nl != NULL ? (size_t)(nl - p) + 1 : 0;
+}
+
+/* Solve one block with <threads> threads and write the answers in order. */
+static int batchBlock(const char *p, size_t len, int binary, int threads, int outFd,
+                      struct batchChunk *chunks, unsigned long *count, unsigned long *errors){
+  pthread_t tids[BATCH_MAX_THREADS];
+  size_t start = 0;
+  for (int t = 0; t < threads; t++) {
+    size_t stop = t == threads - 1 ? len : len * (t + 1) / threads;
+    if (stop < start) {
+      stop = start;
+    }
+    if (t < threads - 1) {
+      stop = start + batchCut(p + start, stop - start, binary, 0);
+    }
+    chunks[t].in = p + start;
+    chunks[t].len = stop - start;
+    chunks[t].binary = binary;
+    chunks[t].outLen = 0;
+    chunks[t].count = 0;
+    chunks[t].errors = 0;
+    start = stop;
+  }
+  for (int t = 1; t < threads; t++) {
+    if (pthread_create(&tids[t], NULL, batchWorker, &chunks[t]) != 0) {
+      perror("pthread_create");
+      return 0;
+    }
+  }
+  batchWorker(&chunks[0]);
+  int ok = 1;
+  for (int t = 0; t < threads; t++) {
+    if (t > 0) {
+      pthread_join(tids[t], NULL);
+    }
+    ok = ok && batchWriteAll(outFd, chunks[t].out, chunks[t].outLen);
+    *count += chunks[t].count;
+    *errors += chunks[t].errors;
+  }
+  return ok;
+}
+
+static int batchMain(int argc, char *argv[]){
+  int binary = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus > 0 ? (int)cpus : 1;
+  const char *outPath = NULL;
+  static struct option longOptions[] = {
+    {"batch", no_argument, 0, 'x'},
+    {"binary", no_argument, 0, 'b'},
+    {"threads", required_argument, 0, 't'},
+    {"out", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'x': break;
+      case 'b': binary = 1; break;
+      case 't': threads = atoi(optarg); break;
+      case 'o': outPath = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s --batch [--binary] [--threads N] [--out FILE] [FILE]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (threads < 1) threads = 1;
+  if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+  const char *inPath = optind < argc ? argv[optind] : "-";
+
+  int inFd = strcmp(inPath, "-") == 0 ? 0 : open(inPath, O_RDONLY);
+  int outFd = outPath == NULL ? 1 : open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (inFd < 0 || outFd < 0) {
+    perror(inFd < 0 ? inPath : outPath);
+    return 1;
+  }
+
+  struct batchChunk chunks[BATCH_MAX_THREADS];
+  memset(chunks, 0, sizeof(chunks));
+  unsigned long count = 0, errors = 0;
+  size_t bytes = 0;
+  int ok = 1;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  if (fstat(inFd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    /* A file: map it and walk it block by block. */
+    size_t size = st.st_size;
+    const char *map = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, inFd, 0);
+    if (map == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    size_t pos = 0;
+    while (ok && pos < size) {
+      size_t len = size - pos < BATCH_BLOCK ? size - pos : BATCH_BLOCK;
+      size_t cut = batchCut(map + pos, len, binary, pos + len == size);
+      if (cut == 0) {
+        cut = len; /* A line longer than a block, it is an error anyway. */
+      }
+      ok = batchBlock(map + pos, cut, binary, threads, outFd, chunks, &count, &errors);
+      pos += cut;
+    }
+    bytes = size;
+    munmap((void *)map, size);
+  } else {
+    /* A pipe: read large blocks, carry a partial record over to the next one. */
+    char *buf = (char *)malloc(BATCH_BLOCK);
+    size_t have = 0;
+    int eof = 0;
+    if (buf == NULL) {
+      perror("batch");
+      return 1;
+    }
+    while (ok && !(eof && have == 0)) {
+      while (!eof && have < BATCH_BLOCK) {
+        ssize_t n = read(inFd, buf + have, BATCH_BLOCK - have);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          eof = 1;
+          break;
+        }
+        have += n;
+        bytes += n;
+      }
+      size_t cut = batchCut(buf, have, binary, eof);
+      if (cut == 0 && binary) {
+        fprintf(stderr, "batch: %zu trailing bytes are not a whole record\n", have);
+        errors++;
+        break;
+      }
+      if (cut == 0) {
+        cut = BATCH_BLOCK; /* A line longer than a block, it is an error anyway. */
+      }
+      ok = batchBlock(buf, cut, binary, threads, outFd, chunks, &count, &errors);
+      memmove(buf, buf + cut, have - cut);
+      have -= cut;
+    }
+    free(buf);
+  }
+  if (binary && S_ISREG(st.st_mode) && st.st_size % sizeof(struct calcProtocol) != 0) {
+    fprintf(stderr, "batch: %zu trailing bytes are not a whole record\n",
+            (size_t)(st.st_size % sizeof(struct calcProtocol)));
+    errors++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  fprintf(stderr, "batch: %lu assignments, %lu errors, %d threads, %.3f s, %.0f ops/s, %.1f MB/s\n",
+          count, errors, threads, seconds, count / seconds, bytes / seconds / 1e6);
+  for (int t = 0; t < BATCH_MAX_THREADS; t++) {
+    free(chunks[t].out);
+  }
+  if (outFd != 1) {
+    close(outFd);
+  }
+  if (!ok) {
+    perror("batch write");
+    return 1;
+  }
+  return errors == 0 ? 0 : 2;
+}
+
+
+/*
+   Check mode: test --check [--count N] [--seed S]
+
+   Differential stress test of the fast paths. <count> assignments are drawn
+   (operators from calcLib, every registry name and a few unknown ones;
+   operands from randomInt(), the whole 32-bit range and its edges), about
+   one text line and one binary record in eight are damaged on purpose, and
+   every assignment goes through the batch solver (text and binary) and the
+   codec (codec.h). Each answer is compared with the ref*() code below, which
+   is written the obvious way and shares nothing with them. Divergences are
+   printed (the first CHECK_REPORT) and make the exit status 1.
+
+   Build with "make SANITIZE=address,undefined" to run it under ASan/UBSan.
+*/
+
+#define CHECK_ROUND 4096 /* Assignments per batch run. */
+#define CHECK_LINE 64
+#define CHECK_REPORT 10
+
+static uint64_t checkState;
+static unsigned long checkDivergences;
+
+/* xorshift64*, calcLib only draws 0..99. */
+static uint32_t checkRandom(void){
+  checkState ^= checkState >> 12;
+  checkState ^= checkState << 25;
+  checkState ^= checkState >> 27;
+  return (uint32_t)((checkState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void checkFail(const char *what, const char *input, const char *got, const char *want){
+  if (checkDivergences++ < CHECK_REPORT) {
+    fprintf(stderr, "check: %s diverges on \"%s\": got %s, want %s\n", what, input, got, want);
+  }
+}
+
+static const char *refNames[] = {"add", "sub", "mul", "div"};
+
+/* 64-bit arithmetic, then wrapped to 32 bits like the server. */
+static int refSolve(const char *name, size_t len, int32_t a, int32_t b, int32_t *result){
+  int64_t v;
+  if (len == 3 && memcmp(name, "add", 3) == 0) {
+    v = (int64_t)a + b;
+  } else if (len == 3 && memcmp(name, "sub", 3) == 0) {
+    v = (int64_t)a - b;
+  } else if (len == 3 && memcmp(name, "mul", 3) == 0) {
+    v = (int64_t)a * b;
+  } else if (len == 3 && memcmp(name, "div", 3) == 0) {
+    if (b == 0 || (a == INT32_MIN && b == -1)) {
+      return 0;
+    }
+    v = a / b;
+  } else {
+    return 0;
+  }
+  *result = (int32_t)(uint32_t)(uint64_t)v;
+  return 1;
+}
+
+static int refInt(const char **pp, int32_t *value){
+  const char *p = *pp;
+  const char *digits = p + (*p == '-' || *p == '+');
+  if (*digits < '0' || *digits > '9') {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  long long v = strtoll(p, &end, 10);
+  if (errno != 0 || v < INT32_MIN || v > INT32_MAX) {
+    return 0;
+  }
+  *value = (int32_t)v;
+  *pp = end;
+  return 1;
+}
+
+/* "name a b" in a NUL-terminated line, see parseTextAssignment(). */
+static int refParse(const char *line, const char **name, size_t *nameLen, int32_t *a, int32_t *b){
+  const char *p = line + strspn(line, " \t");
+  *name = p;
+  *nameLen = strcspn(p, " \t");
+  if (*nameLen == 0) {
+    return 0;
+  }
+  p += *nameLen;
+  if (strspn(p, " \t") == 0) return 0;
+  p += strspn(p, " \t");
+  if (!refInt(&p, a)) return 0;
+  if (strspn(p, " \t") == 0) return 0;
+  p += strspn(p, " \t");
+  if (!refInt(&p, b)) return 0;
+  return p[strspn(p, " \t\r\n")] == '\0';
+}
+
+static int refAnswer(const char *text, int32_t *value){
+  const char *p = text + strspn(text, " \t");
+  return refInt(&p, value) && p[strspn(p, " \t\r\n")] == '\0';
+}
+
+static int32_t checkOperand(void){
+  static const int32_t edges[] = {0, 1, -1, 2, -2, INT32_MIN, INT32_MIN + 1, INT32_MAX, INT32_MAX - 1};
+  uint32_t pick = checkRandom() % 4;
+  if (pick < 2) {
+    return randomInt();
+  }
+  if (pick == 2) {
+    return (int32_t)checkRandom();
+  }
+  return edges[checkRandom() % (sizeof(edges) / sizeof(edges[0]))];
+}
+
+/* Replace, insert or delete a few characters. */
+static void checkDamage(char *line){
+  static const char chars[] = " \t\r+-0123456789adsubmlivx";
+  int edits = 1 + checkRandom() % 3;
+  for (int e = 0; e < edits; e++) {
+    size_t len = strlen(line);
+    size_t at = checkRandom() % (len + 1);
+    char c = chars[checkRandom() % (sizeof(chars) - 1)];
+    uint32_t kind = checkRandom() % 3;
+    if (kind == 0 && at < len) {
+      line[at] = c;
+    } else if (kind == 1 && len + 1 < CHECK_LINE) {
+      memmove(line + at + 1, line + at, len - at + 1);
+      line[at] = c;
+    } else if (at < len) {
+      memmove(line + at, line + at + 1, len - at);
+    }
+  }
+}
+
+static void checkText(const char *line){
+  struct TextAssignment t = {};
+  const char *name = line;
+  size_t nameLen = 0;
+  int32_t a = 0, b = 0, r;
+  int got = parseTextAssignment(line, strlen(line), &t);
+  int want = refParse(line, &name, &nameLen, &a, &b);
+  int known = want && refSolve(name, nameLen, 1, 1, &r);
+  if (got == want && (!got || (t.nameLen == nameLen && memcmp(t.name, name, nameLen) == 0 &&
+                               t.value1 == a && t.value2 == b && (t.op != NULL) == known))) {
+    return;
+  }
+  char gotText[CHECK_LINE + 32] = "malformed", wantText[CHECK_LINE + 32] = "malformed";
+  if (got) {
+    snprintf(gotText, sizeof(gotText), "%.*s %d %d (%s)", (int)t.nameLen, t.name, t.value1, t.value2,
+             t.op != NULL ? "known" : "unknown");
+  }
+  if (want) {
+    snprintf(wantText, sizeof(wantText), "%.*s %d %d (%s)", (int)nameLen, name, a, b, known ? "known" : "unknown");
+  }
+  checkFail("parseTextAssignment", line, gotText, wantText);
+}
+
+static void checkAnswer(const char *text){
+  int32_t got = 0, want = 0;
+  int gotOk = parseTextAnswer(text, strlen(text), &got);
+  int wantOk = refAnswer(text, &want);
+  if (gotOk != wantOk || (gotOk && got != want)) {
+    char gotText[16], wantText[16];
+    snprintf(gotText, sizeof(gotText), gotOk ? "%d" : "malformed", got);
+    snprintf(wantText, sizeof(wantText), wantOk ? "%d" : "malformed", want);
+    checkFail("parseTextAnswer", text, gotText, wantText);
+  }
+}
+
+/* calcProtocol bytes, written out without the codec. */
+static void refRecord(unsigned char *out, uint16_t type, uint32_t id, uint32_t arith, int32_t a, int32_t b, int32_t r){
+  uint32_t words[5] = {id, arith, (uint32_t)a, (uint32_t)b, (uint32_t)r};
+  out[0] = type >> 8;
+  out[1] = type;
+  out[2] = 0;
+  out[3] = 1;
+  out[4] = 0;
+  out[5] = 1;
+  for (int i = 0; i < 5; i++) {
+    for (int k = 0; k < 4; k++) {
+      out[6 + 4 * i + k] = words[i] >> (24 - 8 * k);
+    }
+  }
+}
+
+static void checkRound(int n){
+  static char lines[CHECK_ROUND][CHECK_LINE];
+  static unsigned char records[CHECK_ROUND][sizeof(struct calcProtocol)];
+  static unsigned char answers[CHECK_ROUND][sizeof(struct calcProtocol)];
+  static char text[CHECK_ROUND * CHECK_LINE];
+  size_t textLen = 0;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t pick = checkRandom() % 8;
+    const char *name = pick < 5 ? randomType() : pick < 7 ? refNames[checkRandom() % 4] : "mod";
+    int32_t a = checkOperand(), b = checkOperand(), r = 0;
+    snprintf(lines[i], CHECK_LINE, "%s %d %d%s", name, a, b, checkRandom() % 4 == 0 ? "\r" : "");
+    if (checkRandom() % 8 == 0) {
+      checkDamage(lines[i]);
+    }
+    checkText(lines[i]);
+    size_t len = strlen(lines[i]);
+    memcpy(text + textLen, lines[i], len);
+    text[textLen + len] = '\n';
+    textLen += len + 1;
+
+    uint16_t type = checkRandom() % 8 == 0 ? checkRandom() % 4 : 1;
+    uint32_t arith = 0;
+    for (uint32_t k = 0; k < 4; k++) {
+      arith = strcmp(name, refNames[k]) == 0 ? k + 1 : arith;
+    }
+    if (checkRandom() % 8 == 0) {
+      arith = checkRandom() % 8;
+    }
+    refRecord(records[i], type, i, arith, a, b, 0);
+    int solved = type == 1 && arith >= 1 && arith <= 4 && refSolve(refNames[arith - 1], 3, a, b, &r);
+    refRecord(answers[i], solved ? 2 : 0, i, arith, a, b, solved ? r : 0);
+
+    ProtocolFields f;
+    if (!decodeProtocol(records[i], sizeof(records[i]), &f) || f.type != type || f.major != 1 ||
+        f.minor != 1 || f.id != (uint32_t)i || f.arith != arith || f.value1 != a || f.value2 != b ||
+        f.result != 0 || decodeProtocol(records[i], sizeof(records[i]) - 1 - checkRandom() % 8, &f)) {
+      checkFail("decodeProtocol", lines[i], "other fields", "the record's");
+    }
+
+    char answer[CHECK_LINE];
+    snprintf(answer, sizeof(answer), "%d\n", a);
+    if (checkRandom() % 4 == 0) {
+      checkDamage(answer);
+    }
+    checkAnswer(answer);
+  }
+
+  /* The batch solver on the same assignments. */
+  struct batchChunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.in = text;
+  chunk.len = textLen;
+  batchWorker(&chunk);
+  const char *out = chunk.out;
+  const char *outEnd = chunk.out + chunk.outLen;
+  for (int i = 0; i < n; i++) {
+    if (lines[i][strspn(lines[i], " \t")] == '\0') {
+      continue; /* Blank, gets no answer. */
+    }
+    const char *name;
+    size_t nameLen;
+    int32_t a, b, r;
+    char want[16];
+    if (refParse(lines[i], &name, &nameLen, &a, &b) && refSolve(name, nameLen, a, b, &r)) {
+      snprintf(want, sizeof(want), "%d", r);
+    } else {
+      strcpy(want, "ERROR");
+    }
+    const char *eol = out < outEnd ? (const char *)memchr(out, '\n', outEnd - out) : NULL;
+    char got[16] = "nothing";
+    if (eol != NULL && eol - out < (ptrdiff_t)sizeof(got)) {
+      memcpy(got, out, eol - out);
+      got[eol - out] = '\0';
+    }
+    if (strcmp(got, want) != 0) {
+      checkFail("batch text", lines[i], got, want);
+    }
+    out = eol != NULL ? eol + 1 : outEnd;
+  }
+  free(chunk.out);
+
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.in = (const char *)records;
+  chunk.len = (size_t)n * sizeof(records[0]);
+  chunk.binary = 1;
+  batchWorker(&chunk);
+  for (int i = 0; i < n; i++) {
+    if (chunk.outLen != chunk.len || memcmp(chunk.out + i * sizeof(records[0]), answers[i], sizeof(answers[i])) != 0) {
+      checkFail("batch binary", lines[i], "another record", "the reference record");
+    }
+  }
+  free(chunk.out);
+}
+
+static int checkMain(int argc, char *argv[]){
+  unsigned long count = 1000000;
+  unsigned long seed = (unsigned long)time(NULL);
+  static struct option longOptions[] = {
+    {"check", no_argument, 0, 'x'},
+    {"count", required_argument, 0, 'n'},
+    {"seed", required_argument, 0, 's'},
+    {0, 0, 0, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'x': break;
+      case 'n': count = strtoul(optarg, NULL, 10); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "Usage: %s --check [--count N] [--seed S]\n", argv[0]);
+        return 1;
+    }
+  }
+  initCalcLib_seed((unsigned)seed);
+  checkState = seed * 0x9E3779B97F4A7C15ULL + 1;
+  for (unsigned long done = 0; done < count; done += CHECK_ROUND) {
+    checkRound(count - done < CHECK_ROUND ? (int)(count - done) : CHECK_ROUND);
+  }
+  fprintf(stderr, "check: %lu assignments, seed %lu, %lu divergences\n", count, seed, checkDivergences);
+  return checkDivergences == 0 ? 0 : 1;
+}
+
+
+
 /* Std start to main, argc holds the number of arguments provided to the executable, and *argv[] an 
    array of strings/chars with the arguments (as strings). 
 */
 int main(int argc, char *argv[]){
 
+  if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+    return batchMain(argc, argv);
+  }
+  if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+    return checkMain(argc, argv);
+  }
+
   /* Initialize the library, this is needed for this library. */
   initCalcLib();
   char *ptr;
   ptr=randomType(); // Get a random arithemtic operator. 
 
-  double f1,f2,fresult;
-  int i1,i2,iresult;
+  double f1=0,f2=0,fresult=0;
+  int i1,i2,iresult=0;
   /*
   printf("ptr = %p, \t", ptr );
   printf("string = %s, \n", ptr );
@@ -61,14 +721,9 @@ int main(int argc, char *argv[]){
     }
     printf("%s %8.8g %8.8g = %8.8g\n",ptr,f1,f2,fresult);
   } else {
-    if(strcmp(ptr,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(ptr, "sub")==0){
-      iresult=i1-i2;
-    } else if (strcmp(ptr, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(ptr, "div")==0){
-      iresult=i1/i2;
+    /* Integer operators are looked up in the registry, see operators.h. */
+    if (!opSolve(opByName(ptr, strlen(ptr)), i1, i2, &iresult)) {
+      iresult=0;
     }
 
     printf("%s %d %d = %d \n",ptr,i1,i2,iresult);
@@ -128,17 +783,11 @@ int main(int argc, char *argv[]){
       free(lineBuffer); // This is needed for the getline() as it will allocate memory (if the provided buffer is NUL).
       exit(1);
     }
-    if(strcmp(command,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(command, "sub")==0){
-      iresult=i1-i2;
-      printf("[%s %d %d = %d ]\n",command,i1,i2,iresult);
-    } else if (strcmp(command, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(command, "div")==0){     
-      iresult=i1/i2;
-    } else {
-      printf("No match\n");
+    const Operator *op = opByName(command, strlen(command));
+    if (op == NULL || !opSolve(op, i1, i2, &iresult)) {
+      printf(op == NULL ? "No match\n" : "No result\n");
+      free(lineBuffer);
+      return 1;
     }
 
     printf("%s %d %d = %d \n",command,i1,i2,iresult);
@@ -0,0 +1,214 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+/*
+   The calculator's operators, defined once.
+
+   OPERATORS is the registry: per operator its calcProtocol arith code, its
+   text API name and its 32-bit evaluation. Everything else is generated from
+   it at compile time:
+
+     opByCode(arith)          calcProtocol code -> operator, one table load
+     opByName(name, len)      text name -> operator, a perfect hash and one compare
+     opSolve(op, a, b, &r)    scalar result, false where it is undefined
+     opVerify(op, a, b, r)    is r the answer?
+     opSolveLanes(...)        n assignments at once, vectorized
+
+   Adding an operator is one line in OPERATORS; the server (for what calcLib
+   draws), the clients, the load generator and the batch solver pick it up.
+   Results wrap around in 32 bits like the server's arithmetic. An operator
+   that can trap (div) has lanes = false and is evaluated per assignment
+   after the vector pass instead of in every lane.
+*/
+
+struct Operator {
+  uint32_t code;    // calcProtocol.arith, 1..OP_CODE_LIMIT - 1.
+  const char *name; // Text API name, 1 to 4 characters.
+  int32_t (*apply)(int32_t a, int32_t b);
+  bool (*defined)(int32_t a, int32_t b);
+  bool lanes;       // Safe to evaluate in every vector lane, whatever the operands.
+};
+
+constexpr bool opAlways(int32_t, int32_t) { return true; }
+constexpr bool opDivisible(int32_t a, int32_t b) { return b != 0 && !(a == INT32_MIN && b == -1); }
+
+inline constexpr Operator OPERATORS[] = {
+  {1, "add", [](int32_t a, int32_t b) { return (int32_t)((uint32_t)a + (uint32_t)b); }, opAlways, true},
+  {2, "sub", [](int32_t a, int32_t b) { return (int32_t)((uint32_t)a - (uint32_t)b); }, opAlways, true},
+  {3, "mul", [](int32_t a, int32_t b) { return (int32_t)((uint32_t)a * (uint32_t)b); }, opAlways, true},
+  {4, "div", [](int32_t a, int32_t b) { return a / b; }, opDivisible, false},
+};
+
+constexpr size_t OPERATOR_COUNT = sizeof(OPERATORS) / sizeof(OPERATORS[0]);
+
+/* ---- Generated tables, nothing below needs to change for a new operator. ---- */
+
+#define OP_NAME_BITS 4 // Name hash table of 16 slots.
+
+constexpr size_t opNameLength(const char *name) {
+  size_t n = 0;
+  while (name[n] != '\0') n++;
+  return n;
+}
+
+/* Up to 4 name bytes packed little-endian, 0 for a name that cannot be one. */
+constexpr uint32_t opNameKey(const char *name, size_t len) {
+  if (len == 0 || len > 4) {
+    return 0;
+  }
+  uint32_t key = 0;
+  for (size_t i = 0; i < len; i++) {
+    key |= (uint32_t)(unsigned char)name[i] << (8 * i);
+  }
+  return key;
+}
+
+constexpr uint32_t opNameSlot(uint32_t key, uint32_t mult) { return (key * mult) >> (32 - OP_NAME_BITS); }
+
+/* The first odd multiplier that gives every name its own slot. */
+constexpr uint32_t opFindNameMult() {
+  for (uint32_t mult = 0x9E3779B1u, tries = 0; tries < 100000; mult += 2, tries++) {
+    bool used[1 << OP_NAME_BITS] = {};
+    bool clash = false;
+    for (size_t i = 0; i < OPERATOR_COUNT && !clash; i++) {
+      uint32_t slot = opNameSlot(opNameKey(OPERATORS[i].name, opNameLength(OPERATORS[i].name)), mult);
+      clash = used[slot];
+      used[slot] = true;
+    }
+    if (!clash) {
+      return mult;
+    }
+  }
+  return 0;
+}
+
+constexpr uint32_t opMaxCode() {
+  uint32_t max = 0;
+  for (size_t i = 0; i < OPERATOR_COUNT; i++) {
+    max = OPERATORS[i].code > max ? OPERATORS[i].code : max;
+  }
+  return max;
+}
+
+constexpr bool opRegistryValid() {
+  for (size_t i = 0; i < OPERATOR_COUNT; i++) {
+    if (OPERATORS[i].code == 0 || opNameKey(OPERATORS[i].name, opNameLength(OPERATORS[i].name)) == 0) {
+      return false;
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (OPERATORS[i].code == OPERATORS[j].code) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static_assert(opRegistryValid(), "operator codes must be unique and non-zero, names 1-4 characters");
+static_assert(OPERATOR_COUNT <= (1 << OP_NAME_BITS) / 2, "raise OP_NAME_BITS");
+
+constexpr uint32_t OP_NAME_MULT = opFindNameMult();
+constexpr uint32_t OP_CODE_LIMIT = opMaxCode() + 1;
+
+static_assert(OP_NAME_MULT != 0, "no perfect hash for the operator names, raise OP_NAME_BITS");
+static_assert(OP_CODE_LIMIT <= 256, "operator codes index a table");
+
+struct OpTables {
+  int8_t byCode[OP_CODE_LIMIT];             // Index into OPERATORS, -1 if none.
+  uint32_t nameKey[1 << OP_NAME_BITS];      // Key of the name in each slot, 0 if empty.
+  int8_t byName[1 << OP_NAME_BITS];
+};
+
+constexpr OpTables opMakeTables() {
+  OpTables t = {};
+  for (uint32_t c = 0; c < OP_CODE_LIMIT; c++) {
+    t.byCode[c] = -1;
+  }
+  for (size_t i = 0; i < OPERATOR_COUNT; i++) {
+    uint32_t key = opNameKey(OPERATORS[i].name, opNameLength(OPERATORS[i].name));
+    uint32_t slot = opNameSlot(key, OP_NAME_MULT);
+    t.byCode[OPERATORS[i].code] = (int8_t)i;
+    t.nameKey[slot] = key;
+    t.byName[slot] = (int8_t)i;
+  }
+  return t;
+}
+
+inline constexpr OpTables OP_TABLES = opMakeTables();
+
+static inline const Operator *opByCode(uint32_t code) {
+  if (code >= OP_CODE_LIMIT || OP_TABLES.byCode[code] < 0) {
+    return NULL;
+  }
+  return &OPERATORS[OP_TABLES.byCode[code]];
+}
+
+static inline const Operator *opByName(const char *name, size_t len) {
+  uint32_t key = 0;
+  if (len >= 1 && len <= 4) {
+    memcpy(&key, name, len); // Little-endian hosts, as opNameKey().
+  }
+  uint32_t slot = opNameSlot(key, OP_NAME_MULT);
+  if (key == 0 || OP_TABLES.nameKey[slot] != key) {
+    return NULL;
+  }
+  // The key of "add\0" is the key of "add"; the length tells them apart.
+  const Operator *op = &OPERATORS[OP_TABLES.byName[slot]];
+  return strlen(op->name) == len ? op : NULL;
+}
+
+static inline bool opSolve(const Operator *op, int32_t a, int32_t b, int32_t *result) {
+  if (op == NULL || !op->defined(a, b)) {
+    return false;
+  }
+  *result = op->apply(a, b);
+  return true;
+}
+
+static inline bool opVerify(const Operator *op, int32_t a, int32_t b, int32_t answer) {
+  int32_t r;
+  return opSolve(op, a, b, &r) && r == answer;
+}
+
+/* One vector pass: every lane computes every lane-safe operator and keeps the
+   one it asked for, so the loop has no branches and becomes SIMD compares and
+   blends. ok[i] is cleared for a code that names no operator. */
+template <size_t... K>
+static inline void opSolveVector(const int32_t *arith, const int32_t *a, const int32_t *b, int32_t *r,
+                                 unsigned char *ok, int n, std::index_sequence<K...>) {
+  for (int i = 0; i < n; i++) {
+    int32_t code = arith[i], x = a[i], y = b[i], v = 0;
+    bool known = false;
+    auto lane = [&](auto k) {
+      constexpr Operator op = OPERATORS[decltype(k)::value];
+      known |= code == (int32_t)op.code;
+      if constexpr (op.lanes) {
+        int32_t w = op.apply(x, y);
+        v = code == (int32_t)op.code ? w : v;
+      }
+    };
+    (lane(std::integral_constant<size_t, K>()), ...);
+    r[i] = v;
+    ok[i] &= known;
+  }
+}
+
+/* Solve n assignments given by arith code. ok[i] must come in set for the
+   lanes that parsed and is cleared for anything unsolvable (r[i] = 0 then). */
+static inline void opSolveLanes(const int32_t *arith, const int32_t *a, const int32_t *b, int32_t *r,
+                                unsigned char *ok, int n) {
+  opSolveVector(arith, a, b, r, ok, n, std::make_index_sequence<OPERATOR_COUNT>());
+  for (int i = 0; i < n; i++) {
+    const Operator *op = ok[i] ? opByCode((uint32_t)arith[i]) : NULL;
+    if (op != NULL && !op->lanes) {
+      ok[i] = opSolve(op, a[i], b[i], &r[i]);
+      if (!ok[i]) {
+        r[i] = 0;
+      }
+    }
+  }
+}
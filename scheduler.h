@@ -0,0 +1,236 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "admission.h"
+
+/*
+   Fair scheduling of the ready work of one worker.
+
+   The loop does not handle a session the moment epoll reports it. It queues
+   a work item under the session's client (source address) and a class, and
+   then runs the queues:
+
+     - SCHED_ACTIVE, sessions that hold an assignment and wait for the answer,
+       runs before SCHED_NEW, handshakes and hellos, so a flood of new sessions
+       does not delay answers that are already on their way. SCHED_NEW still
+       gets 1/SCHED_NEW_SHARE of the budget while it has work: it is slowed
+       down, not starved.
+     - Within a class, clients take turns by deficit round robin. A turn gives
+       the client <quantum> units of credit, an item costs one unit, and the
+       credit left when the budget runs out mid-turn is kept for the next
+       iteration. A client that has nothing queued has no credit.
+     - At most <budget> units run per loop iteration. The rest waits until
+       epoll has been polled again, so a client with thousands of ready
+       sessions gets its share of each round, not the worker.
+
+   Items are values the owner interprets. One that has gone stale while it
+   waited (its session ended) must be recognisable when it runs. Single
+   threaded, like everything a worker owns.
+*/
+
+enum SchedClass { SCHED_ACTIVE, SCHED_NEW, SCHED_CLASSES };
+
+#define SCHED_NEW_SHARE 8 // New work's guaranteed part of the budget, 1/8.
+
+struct SchedStats {
+  uint64_t ran;
+  uint64_t carried; // Loop iterations that ended with work still queued.
+  size_t peak;      // Most items queued at once.
+};
+
+template <typename Item>
+class FairScheduler {
+public:
+  FairScheduler() : quantum(1), queued(0) {
+    memset(&stats, 0, sizeof(stats));
+  }
+
+  void configure(int unitsPerTurn) {
+    quantum = unitsPerTurn > 0 ? (size_t)unitsPerTurn : 1;
+  }
+
+  void push(const IpKey &client, SchedClass cls, const Item &item) {
+    Class &c = classes[cls];
+    Flow &f = c.flows[client];
+    if (f.items.empty()) {
+      f.client = client;
+      f.deficit = 0;
+      c.turns.push_back(&f);
+    }
+    f.items.push_back(item);
+    queued++;
+    stats.peak = std::max(stats.peak, queued);
+  }
+
+  bool empty() const { return queued == 0; }
+  size_t size() const { return queued; }
+
+  /* Run up to <budget> items (0 = everything queued) through handle(item),
+     which must not push. Returns how many ran. */
+  template <typename Handler>
+  size_t run(size_t budget, Handler handle) {
+    if (budget == 0 || budget > queued) {
+      budget = queued;
+    }
+    size_t newShare = 0;
+    if (!classes[SCHED_NEW].turns.empty()) {
+      newShare = (budget + SCHED_NEW_SHARE - 1) / SCHED_NEW_SHARE;
+    }
+    size_t ran = runClass(classes[SCHED_ACTIVE], budget - newShare, handle);
+    ran += runClass(classes[SCHED_NEW], budget - ran, handle);
+    stats.ran += ran;
+    stats.carried += queued > 0;
+    return ran;
+  }
+
+  SchedStats stats;
+
+private:
+  struct Flow {
+    IpKey client;
+    std::deque<Item> items;
+    size_t deficit;
+  };
+
+  struct Class {
+    // Node based, so a Flow stays put while other clients come and go.
+    std::unordered_map<IpKey, Flow, IpKeyHash> flows;
+    std::deque<Flow *> turns; // Clients with work, the one whose turn it is first.
+  };
+
+  template <typename Handler>
+  size_t runClass(Class &c, size_t budget, Handler &handle) {
+    size_t ran = 0;
+    while (ran < budget && !c.turns.empty()) {
+      Flow *f = c.turns.front();
+      if (f->deficit == 0) {
+        f->deficit = quantum;
+      }
+      while (f->deficit > 0 && !f->items.empty() && ran < budget) {
+        Item item = f->items.front();
+        f->items.pop_front();
+        f->deficit--;
+        queued--;
+        ran++;
+        handle(item);
+      }
+      if (f->items.empty()) {
+        c.turns.pop_front();
+        c.flows.erase(f->client);
+      } else if (f->deficit == 0) {
+        c.turns.pop_front();
+        c.turns.push_back(f);
+      }
+    }
+    return ran;
+  }
+
+  size_t quantum;
+  size_t queued;
+  Class classes[SCHED_CLASSES];
+};
+
+/*
+   Session latency per client, to check that the scheduler keeps the clients'
+   p99 close together. Log-spaced buckets, four per power of two of
+   microseconds, so a quantile is within 19% and never below the true value.
+   At most CLIENT_LATENCY_MAX clients are told apart (UDP source addresses
+   cost an attacker nothing); the rest share one entry with address ::.
+*/
+
+#define CLIENT_LATENCY_BUCKETS 128
+#define CLIENT_LATENCY_MAX 4096
+
+struct ClientLatencySummary {
+  IpKey client;
+  uint64_t count;
+  uint64_t p50; // Nanoseconds.
+  uint64_t p99;
+  uint64_t max;
+};
+
+class ClientLatency {
+public:
+  void record(const IpKey &client, uint64_t ns) {
+    std::unordered_map<IpKey, Entry, IpKeyHash>::iterator it = clients.find(client);
+    if (it == clients.end()) {
+      IpKey key = client;
+      if (clients.size() >= CLIENT_LATENCY_MAX) {
+        memset(&key, 0, sizeof(key));
+      }
+      it = clients.emplace(key, Entry()).first;
+    }
+    Entry &e = it->second;
+    e.counts[bucketOf(ns)]++;
+    e.total++;
+    e.max = std::max(e.max, ns);
+  }
+
+  size_t size() const { return clients.size(); }
+
+  /* One summary per client, highest p99 first. */
+  std::vector<ClientLatencySummary> summaries() const {
+    std::vector<ClientLatencySummary> out;
+    for (std::unordered_map<IpKey, Entry, IpKeyHash>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+      ClientLatencySummary s;
+      s.client = it->first;
+      s.count = it->second.total;
+      s.p50 = quantile(it->second, 0.50);
+      s.p99 = quantile(it->second, 0.99);
+      s.max = it->second.max;
+      out.push_back(s);
+    }
+    std::sort(out.begin(), out.end(), [](const ClientLatencySummary &a, const ClientLatencySummary &b) {
+      return a.p99 > b.p99;
+    });
+    return out;
+  }
+
+private:
+  struct Entry {
+    Entry() : total(0), max(0) { memset(counts, 0, sizeof(counts)); }
+    uint32_t counts[CLIENT_LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+  };
+
+  static int bucketOf(uint64_t ns) {
+    uint64_t us = ns >> 10;
+    if (us < 4) {
+      return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int b = 4 * (msb - 1) + (int)((us >> (msb - 2)) & 3);
+    return b < CLIENT_LATENCY_BUCKETS ? b : CLIENT_LATENCY_BUCKETS - 1;
+  }
+
+  /* The largest value in bucket <b>, in nanoseconds. */
+  static uint64_t bucketTop(int b) {
+    if (b < 4) {
+      return ((uint64_t)b + 1) << 10;
+    }
+    int msb = b / 4 + 1;
+    uint64_t low = (uint64_t)(4 + b % 4) << (msb - 2);
+    return (low + (1ULL << (msb - 2))) << 10;
+  }
+
+  static uint64_t quantile(const Entry &e, double q) {
+    uint64_t rank = (uint64_t)(q * (double)e.total);
+    uint64_t seen = 0;
+    for (int b = 0; b < CLIENT_LATENCY_BUCKETS; b++) {
+      seen += e.counts[b];
+      if (seen > rank) {
+        return std::min(bucketTop(b), e.max);
+      }
+    }
+    return e.max;
+  }
+
+  std::unordered_map<IpKey, Entry, IpKeyHash> clients;
+};
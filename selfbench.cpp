@@ -0,0 +1,236 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "selfbench.h"
+
+/*
+   Implementation of selfbench.h. The points of a curve are run one after
+   the other; loadRun() returns only once every session of a point has
+   finished or timed out, so a point never inherits the backlog of the one
+   before it.
+*/
+
+#define SELF_BENCH_TIMEOUT_MS 1000 // Per session; anything slower is far past any target.
+#define SELF_BENCH_COMPLETE 0.99   // Fraction of started sessions that must complete.
+#define SELF_BENCH_GIVE_UP 10      // Stop a curve once p99 exceeds the target this many times.
+
+struct BenchPoint {
+  double at;        // Seconds since the sweep started.
+  double offered;   // Sessions per second.
+  double achieved;
+  LoadResult r;
+  bool sustained;   // Kept up, see SELF_BENCH_COMPLETE.
+};
+
+struct BenchCurve {
+  int batch;
+  LoadTransport transport;
+  LoadApi api;
+  int inFlight;
+  std::vector<BenchPoint> points;
+  int knee;         // Index into points, -1 if none kept up.
+  int sustainable;  // Index of the max sustainable point, -1 if none.
+};
+
+static double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double p99Us(const LoadResult &r) {
+  return r.latency.quantile(0.99) / 1e3;
+}
+
+static void findKnee(const SelfBenchConfig &cfg, BenchCurve *c) {
+  double bestPower = 0;
+  c->knee = -1;
+  c->sustainable = -1;
+  for (size_t i = 0; i < c->points.size(); i++) {
+    const BenchPoint &p = c->points[i];
+    if (!p.sustained) {
+      continue;
+    }
+    double p99 = p99Us(p.r);
+    double power = p.achieved / (p99 > 0 ? p99 : 1);
+    if (power > bestPower) {
+      bestPower = power;
+      c->knee = i;
+    }
+    if (p99 <= cfg.targetP99Us && (c->sustainable < 0 || p.achieved > c->points[c->sustainable].achieved)) {
+      c->sustainable = i;
+    }
+  }
+}
+
+static void runCurve(const SelfBenchConfig &cfg, double sweepStart, BenchCurve *c) {
+  LoadConfig load;
+  memset(&load, 0, sizeof(load));
+  load.transport = c->transport;
+  load.api = c->api;
+  memcpy(&load.addr, &cfg.addr, cfg.addrLen);
+  load.addrLen = cfg.addrLen;
+  load.threads = cfg.threads;
+  load.maxInFlight = c->inFlight;
+  load.duration = cfg.step;
+  load.timeoutMs = SELF_BENCH_TIMEOUT_MS;
+  load.pin = false; // The server's workers share the cores.
+  for (double rate = cfg.startRate; rate <= cfg.maxRate && !*cfg.stop; rate *= cfg.growth) {
+    BenchPoint p;
+    p.at = nowSeconds() - sweepStart;
+    p.offered = rate;
+    load.rate = rate;
+    if (!loadRun(load, &p.r)) {
+      break;
+    }
+    p.achieved = p.r.elapsed > 0 ? p.r.completed / p.r.elapsed : 0;
+    p.sustained = p.r.failed == 0 && p.r.timeouts == 0 && p.r.unsent == 0 &&
+                  p.r.completed >= SELF_BENCH_COMPLETE * p.r.started;
+    c->points.push_back(p);
+    printf("bench batch %d %s %s in-flight %d: offered %.0f/s, achieved %.0f/s, p50 %.1f us, p99 %.1f us%s\n",
+           c->batch, loadTransportName(c->transport), loadApiName(c->api), c->inFlight, rate, p.achieved,
+           p.r.latency.quantile(0.50) / 1e3, p99Us(p.r), p.sustained ? "" : ", falling behind");
+    fflush(stdout);
+    if (!p.sustained || p99Us(p.r) > SELF_BENCH_GIVE_UP * cfg.targetP99Us) {
+      break;
+    }
+  }
+  findKnee(cfg, c);
+}
+
+static void writePoint(FILE *f, const BenchPoint &p) {
+  const Histogram &h = p.r.latency;
+  fprintf(f, "{\"t_s\":%.3f,\"offered\":%.1f,\"achieved\":%.1f,\"started\":%llu,\"completed\":%llu,"
+          "\"failed\":%llu,\"timeouts\":%llu,\"unsent\":%llu,\"sustained\":%s,"
+          "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p99.9_us\":%.3f,\"max_us\":%.3f}",
+          p.at, p.offered, p.achieved, (unsigned long long)p.r.started, (unsigned long long)p.r.completed,
+          (unsigned long long)p.r.failed, (unsigned long long)p.r.timeouts, (unsigned long long)p.r.unsent,
+          p.sustained ? "true" : "false", h.quantile(0.50) / 1e3, h.quantile(0.90) / 1e3, h.quantile(0.99) / 1e3,
+          h.quantile(0.999) / 1e3, h.max() / 1e3);
+}
+
+static bool writeReport(const SelfBenchConfig &cfg, const std::vector<BenchCurve> &curves, double seconds,
+                        const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0) {
+    strcpy(host, "unknown");
+  }
+  host[sizeof(host) - 1] = '\0';
+  // Hostname characters only, so the name needs no JSON escaping.
+  for (char *p = host; *p != '\0'; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '-' && *p != '.' && *p != '_') {
+      *p = '_';
+    }
+  }
+  time_t now = time(NULL);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  fprintf(f, "{\"host\":\"%s\",\"cpus\":%ld,\"date\":\"%s\",\"build\":\"%s %s, %s\",\"workers\":%d,"
+          "\"load_threads\":%d,\"target_p99_us\":%.1f,\"step_s\":%.3f,\"duration_s\":%.1f,\n\"curves\":[",
+          host, sysconf(_SC_NPROCESSORS_ONLN), date, __DATE__, __TIME__, __VERSION__, cfg.workers, cfg.threads,
+          cfg.targetP99Us, cfg.step, seconds);
+  for (size_t i = 0; i < curves.size(); i++) {
+    const BenchCurve &c = curves[i];
+    fprintf(f, "%s\n {\"batch\":%d,\"transport\":\"%s\",\"api\":\"%s\",\"max_in_flight\":%d,",
+            i == 0 ? "" : ",", c.batch, loadTransportName(c.transport), loadApiName(c.api), c.inFlight);
+    fprintf(f, "\"max_sustainable\":%.1f,", c.sustainable >= 0 ? c.points[c.sustainable].achieved : 0.0);
+    fprintf(f, "\"knee\":");
+    if (c.knee >= 0) {
+      writePoint(f, c.points[c.knee]);
+    } else {
+      fprintf(f, "null");
+    }
+    fprintf(f, ",\n  \"points\":[");
+    for (size_t j = 0; j < c.points.size(); j++) {
+      fprintf(f, "%s\n   ", j == 0 ? "" : ",");
+      writePoint(f, c.points[j]);
+    }
+    fprintf(f, "]}");
+  }
+
+  // Per transport and API the best curve over batch sizes and concurrencies.
+  fprintf(f, "\n],\n\"summary\":[");
+  bool first = true;
+  for (int t = LOAD_TCP; t <= LOAD_UDP; t++) {
+    for (int a = LOAD_TEXT; a <= LOAD_BINARY; a++) {
+      const BenchCurve *best = NULL;
+      for (size_t i = 0; i < curves.size(); i++) {
+        const BenchCurve &c = curves[i];
+        if (c.transport != t || c.api != a || c.sustainable < 0) {
+          continue;
+        }
+        if (best == NULL || c.points[c.sustainable].achieved > best->points[best->sustainable].achieved) {
+          best = &c;
+        }
+      }
+      fprintf(f, "%s\n {\"transport\":\"%s\",\"api\":\"%s\",", first ? "" : ",",
+              loadTransportName((LoadTransport)t), loadApiName((LoadApi)a));
+      first = false;
+      if (best == NULL) {
+        fprintf(f, "\"max_sustainable\":0}");
+        continue;
+      }
+      const BenchPoint &p = best->points[best->sustainable];
+      fprintf(f, "\"max_sustainable\":%.1f,\"p99_us\":%.3f,\"batch\":%d,\"max_in_flight\":%d}",
+              p.achieved, p99Us(p.r), best->batch, best->inFlight);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+bool selfBenchRun(const SelfBenchConfig &cfg, const std::function<bool(int batch)> &start,
+                  const std::function<void()> &stop, const char *path) {
+  if (cfg.startRate <= 0 || cfg.growth <= 1 || cfg.step <= 0 || cfg.threads < 1) {
+    return false;
+  }
+  std::vector<BenchCurve> curves;
+  double sweepStart = nowSeconds();
+  bool started = true;
+  for (size_t b = 0; b < cfg.batches.size() && !*cfg.stop; b++) {
+    if (!start(cfg.batches[b])) {
+      started = false; // What the earlier batch sizes measured is still reported.
+      break;
+    }
+    for (int t = LOAD_TCP; t <= LOAD_UDP; t++) {
+      for (int a = LOAD_TEXT; a <= LOAD_BINARY; a++) {
+        for (size_t i = 0; i < cfg.inFlight.size() && !*cfg.stop; i++) {
+          BenchCurve c;
+          c.batch = cfg.batches[b];
+          c.transport = (LoadTransport)t;
+          c.api = (LoadApi)a;
+          c.inFlight = cfg.inFlight[i];
+          runCurve(cfg, sweepStart, &c);
+          curves.push_back(c);
+        }
+      }
+    }
+    stop();
+  }
+  return writeReport(cfg, curves, nowSeconds() - sweepStart, path) && started;
+}
+
+bool selfBenchParseList(const char *list, std::vector<int> *out) {
+  out->clear();
+  const char *p = list;
+  for (;;) {
+    char *end;
+    long v = strtol(p, &end, 10);
+    if (end == p || v < 0 || v > 1 << 20 || (*end != ',' && *end != '\0')) {
+      return false;
+    }
+    out->push_back((int)v);
+    if (*end == '\0') {
+      return true;
+    }
+    p = end + 1;
+  }
+}
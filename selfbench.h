@@ -0,0 +1,58 @@
+#pragma once
+#include <signal.h>
+#include <stddef.h>
+#include <functional>
+#include <vector>
+#include <sys/socket.h>
+
+#include "loadgen.h"
+
+/*
+   Capacity report of one build on one host: the server under the open-loop
+   load generator (loadgen.h), both in the same process, on loopback.
+
+   For every server batch size (work items per loop iteration), every
+   transport and API and every load concurrency (sessions in flight per
+   load thread) the offered rate starts at <startRate> and is multiplied by
+   <growth> each step of <step> seconds, until the server falls behind
+   (sessions fail, time out or cannot be started, or fewer than 99% of the
+   started ones complete), p99 exceeds ten times the target, or <maxRate>
+   is reached. Each step is one point of a throughput-vs-latency curve:
+
+     max sustainable  the highest achieved rate of a step that kept up with
+                      p99 at or below the target
+     knee             the step with the highest achieved rate per p99
+                      (Kleinrock's power): past it, more load buys more
+                      latency than throughput
+
+   The report is one JSON document with every point, stamped with its
+   offset from the start, so a run can also be read as a time series.
+*/
+
+struct SelfBenchConfig {
+  struct sockaddr_storage addr; // The server under test.
+  socklen_t addrLen;
+  std::vector<int> batches;     // Server batch sizes, 0 = all ready work.
+  std::vector<int> inFlight;    // Load concurrencies.
+  double targetP99Us;
+  double step;                  // Seconds per point.
+  double startRate;             // Sessions per second of the first point.
+  double growth;                // Offered rate factor from one point to the next.
+  double maxRate;
+  int threads;                  // Load generator threads.
+  int workers;                  // Server workers, for the report.
+  const volatile sig_atomic_t *stop; // Abandon the sweep once set (SIGINT).
+};
+
+/*
+   Run the sweep and write the report to <path>. <start> starts a server
+   with the given batch size, <stop> stops it again; they are called once
+   per batch size, around the curves of that size. If <start> fails the
+   sweep ends there, the report still holds the curves measured so far and
+   the result is false.
+*/
+bool selfBenchRun(const SelfBenchConfig &cfg, const std::function<bool(int batch)> &start,
+                  const std::function<void()> &stop, const char *path);
+
+/* "16,64" into <out>, false on anything but non-negative integers. */
+bool selfBenchParseList(const char *list, std::vector<int> *out);
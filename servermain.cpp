@@ -2,32 +2,2154 @@
 #include <string.h>
 #include <stdlib.h>
 /* You will to add includes here */
-
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <new>
 
 // Included to get the support library
 #include <calcLib.h>
 
+#include "protocol.h"
+#include "operators.h"
+#include "codec.h"
+#include "admission.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "handoff.h"
+#include "shmtransport.h"
+#include "coro.h"
+#include "sessionlog.h"
+#include "topology.h"
+#include "selfbench.h"
+
 // Enable if you want debugging to be printed, see examble below.
 // Alternative, pass CFLAGS=-DDEBUG to make, make CFLAGS=-DDEBUG
 #define DEBUG
 
+/*
+   Calculator server, TCP and UDP on the same port, text and binary API.
+
+   Every worker is a thread with its own epoll loop and its own SO_REUSEPORT
+   TCP listener and UDP socket, so workers share nothing. New sessions are
+   admitted by the worker's AdmissionControl (admission.h) before any state
+   is allocated for them; rejected TCP clients are closed at once and rejected
+   UDP clients get a calcMessage NOT OK.
+
+   A TCP session is a coroutine (coro.h) written top to bottom like a
+   blocking handler; while it waits for its client it is one pooled frame.
+   UDP and shared-memory sessions are one request and one reply, kept in
+   tables the hot restart can copy.
+
+   TCP output is queued per connection and written once per loop iteration,
+   after every ready event has been handled, on sockets with TCP_NODELAY. The
+   verdict goes with MSG_MORE and then shutdown(), so it shares its segment
+   with the FIN: a session is three writes and three data segments from the
+   server. --no-coalesce writes each message at once with Nagle on, to
+   compare against.
+
+   Slow consumers: queued output lives in chained chunks from the worker's
+   pool (coro.h), at most --output-pool bytes for all its connections. A
+   session whose client leaves more than --send-highwater bytes unread
+   stops, and is not read from, until the client is down to --send-lowwater.
+   One whose client took nothing for --write-timeout is dropped at the next
+   sweep, and a send the full pool cannot take drops its session at once, so
+   thousands of stalled clients cost a bounded amount of memory.
+
+   Fair scheduling: ready TCP sessions and received datagrams are not handled
+   straight from epoll. They are queued per client in the worker's
+   FairScheduler (scheduler.h), which runs --sched-budget items per loop
+   iteration, deficit round robin over the clients, answers before new
+   handshakes. The stats at exit show how session latency spreads over the
+   clients.
+
+   Session log (--session-log DIR): every assignment that was handed out is
+   appended as one SessionRecord (sessionlog.h) to a per-worker mmap'd
+   segment, with its outcome and latency; logtool turns sealed segments into
+   columns and rollups offline.
+
+   TCP session:
+     server: "TEXT TCP 1.1\nBINARY TCP 1.1\nCAPS 7 <ticket>\n\n"
+     client: "TEXT TCP 1.1 OK\n" or "BINARY TCP 1.1 OK\n"
+     server: "add 1 2\n"            or calcProtocol (type 1)
+     client: "3\n"                  or calcProtocol (type 2)
+     server: "OK\n" / "ERROR\n"     or calcMessage (message 1/2)
+
+   A client that kept the CAPS line may skip the list next time: it sends a
+   resume frame (codec.h) right after connecting and gets a one-byte ACK in
+   front of the assignment, or a NAK and the list. Tickets survive a hot
+   restart, not a cold one.
+
+   UDP session:
+     client: "TEXT UDP 1.1\n"       or calcMessage (type 22)
+     server: "add 1 2\n"            or calcProtocol (type 1)
+     client: "3\n"                  or calcProtocol (type 2)
+     server: "OK\n" / "ERROR\n"     or calcMessage (message 1/2)
+
+   Hot restart: a server started with --handoff PATH hands its listening
+   sockets to a new server started with --takeover PATH. The workers stop
+   accepting and stop reading UDP, their UDP sessions and queued datagrams
+   are sent along with the sockets, and the old process keeps serving its
+   open TCP sessions until they finish or the drain timeout passes. A
+   successor that stalls for HANDOFF_TIMEOUT_MS fails the handoff, and the
+   old process goes on serving.
+
+   Busy poll (--busy-poll): for the lowest UDP latency a worker spins on a
+   non-blocking recvmmsg() instead of sleeping in epoll_wait(), with
+   SO_BUSY_POLL/SO_PREFER_BUSY_POLL set so the kernel polls the device queue
+   as well. After --busy-poll-idle microseconds without a datagram the worker
+   goes back to blocking in epoll_wait() until traffic returns. Workers are
+   pinned to one core each in this mode.
+
+   Shared memory (--shm NAME): clients on the same host can hand worker 0 a
+   channel of two SPSC rings (shmtransport.h) and run UDP sessions over it,
+   same frames, no sockets on the data path. Under --busy-poll the worker
+   polls the rings while it spins, so neither side makes a system call.
+
+   NUMA (--numa): workers are pinned by topologyPlace() (topology.h), on the
+   CPUs that process the NIC's packets first and then outwards by node
+   distance, and set SO_INCOMING_CPU so SO_REUSEPORT hands each worker the
+   flows its CPU received. A worker's own state is allocated on its node,
+   and the worker thread prefers its node for everything it allocates later
+   (datagram buffers, coroutine frames, session tables, session log pages).
+   --numa-stats counts, per worker, the connections and UDP reads whose
+   packets were processed on another node, with or without --numa.
+
+   Self-bench (--self-bench FILE): instead of serving, the server runs the
+   load generator against its own workers on loopback, over TCP and UDP,
+   text and binary, sweeping load concurrency, --sched-budget and offered
+   rate, and writes the throughput-vs-latency curves with their knee and the
+   highest rate that meets --bench-p99 as JSON (selfbench.h).
+*/
+
+#define PROTOCOL_LIST "TEXT TCP 1.1\nBINARY TCP 1.1\n"
+#define SERVER_CAPS (CAPS_TEXT_TCP | CAPS_BINARY_TCP | CAPS_RESUME)
+#define MAX_LINE 256
+#define UDP_TIMEOUT_MS 10000
+#define UDP_PENDING_MAX 1024
+#define EVENTS_PER_WAIT 256
+#define ACCEPTS_PER_WAKE 64
+#define DATAGRAMS_PER_WAKE 64
+#define MAX_DATAGRAM 1500
+#define UDP_QUEUE_MAX 4096 // Datagrams read but not yet run by the scheduler.
+#define HANDOFF_MAGIC 0x43414c31 // "CAL1"
+#define HANDOFF_TIMEOUT_MS 5000 // Per step of a hot restart, for the peer and for the workers.
+
+// Not in older libc headers, values from the kernel uapi.
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+struct ServerConfig {
+  const char *host;
+  int port;
+  int workers;
+  int maxSessions;      // Concurrent sessions per worker, TCP and UDP together.
+  int maxPerIp;         // Concurrent sessions per source address, per worker.
+  double rate;          // New sessions per second per worker, 0 = unlimited.
+  double burst;         // Token bucket depth.
+  size_t sendHighWater; // Stop reading a connection above this many unsent bytes...
+  size_t sendLowWater;  // ...until it is down to this many.
+  int writeTimeoutMs;   // Drop a TCP session whose client took no output for this long.
+  size_t outputPool;    // Bytes of TCP output per worker, all connections together.
+  int sessionTimeoutMs;
+  const char *tracePath; // Chrome trace JSON written on SIGUSR1 and at exit.
+  unsigned traceSample;  // Trace one session in N.
+  const char *handoffPath;  // Accept a successor on this unix socket.
+  const char *takeoverPath; // Take the sockets of the server on this unix socket.
+  int drainTimeoutMs;       // How long the old process keeps serving after a handoff.
+  bool busyPoll;            // Spin on the UDP socket instead of sleeping in epoll.
+  int busyPollIdleUs;       // Go back to blocking after this long without datagrams.
+  int pinCpu;               // Pin worker i to CPU pinCpu + i, -1 = no pinning.
+  const char *shmName;      // Accept shared-memory channels as calc-shm-<name>.
+  bool coalesce;            // Batch TCP output per loop iteration, TCP_NODELAY on.
+  size_t schedBudget;       // Work items per loop iteration, 0 = all that are ready.
+  int schedQuantum;         // Work items per client turn.
+  const char *sessionLogDir; // Append a SessionRecord per assignment to segments here.
+  size_t sessionLogRecords;  // Records per segment.
+  bool numa;                 // Place workers by topology, bind their memory, steer flows.
+  bool numaStats;            // Count arrivals processed on another node than the worker's.
+  const char *nic;           // Interface for --numa, default the one holding <host>.
+  const Topology *topology;  // Read at startup with --numa or --numa-stats.
+};
+
+enum ApiType { API_TEXT, API_BINARY };
+
+struct Assignment {
+  uint32_t id;
+  uint32_t arith; // 1-4, as in protocol.h
+  int32_t value1;
+  int32_t value2;
+  int32_t result;
+};
+
+/* What an epoll event with a session tag belongs to. */
+enum EventSource { SOURCE_TCP, SOURCE_SHM_RING, SOURCE_SHM_CONTROL };
+
+struct EpollTag {
+  EventSource source;
+  void *owner;
+};
+
+/* Lives in the frame of its serveTcp() coroutine. */
+struct TcpSession {
+  EpollTag tag;
+  CoroConn conn;
+  IpKey ip;
+  uint64_t deadline;
+  uint64_t serial;      // Tells a step queued for this session from one for a later one on the fd.
+  uint64_t started;     // Accepted, for the per-client latency.
+  uint32_t readyEvents; // Reported by epoll, not yet passed to the conn.
+  bool scheduled;       // A step is queued.
+  bool assigned;        // Past the handshake, its steps are SCHED_ACTIVE.
+};
+
+struct UdpPeer {
+  IpKey ip;
+  uint16_t port;
+
+  bool operator==(const UdpPeer &o) const { return ip == o.ip && port == o.port; }
+};
+
+struct UdpPeerHash {
+  size_t operator()(const UdpPeer &p) const { return IpKeyHash()(p.ip) ^ p.port; }
+};
+
+struct UdpSession {
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  ApiType api;
+  uint64_t started; // The hello was read.
+  uint64_t deadline;
+  Assignment task;
+  uint32_t traceId;
+  uint64_t phaseStart;
+};
+
+/* Shared-memory clients have no address, they share one key for the per-IP limit. */
+static const IpKey SHM_CLIENT = {0, 0};
+
+/* A shared-memory channel runs UDP sessions one after the other. */
+struct ShmSession {
+  EpollTag ringTag;    // The client woke us through the channel eventfd.
+  EpollTag controlTag; // The client closed its unix socket.
+  int controlFd;
+  ShmEndpoint ep;
+  bool active; // An assignment is waiting for its answer.
+  ApiType api;
+  uint64_t started; // The hello was read.
+  uint64_t deadline;
+  Assignment task;
+  uint32_t traceId;
+  uint64_t phaseStart;
+};
+
+/* A datagram read from the UDP socket, waiting for its turn. */
+struct QueuedDatagram {
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  uint64_t readAt;
+  size_t len;
+  char data[MAX_DATAGRAM];
+};
+
+/* Work for the worker's FairScheduler. */
+enum WorkKind { WORK_TCP_START, WORK_TCP_STEP, WORK_DATAGRAM };
+
+struct WorkItem {
+  WorkKind kind;
+  int fd;                   // TCP.
+  IpKey ip;                 // WORK_TCP_START.
+  uint64_t at;              // WORK_TCP_START: when it was accepted.
+  uint64_t serial;          // WORK_TCP_STEP: TcpSession::serial.
+  QueuedDatagram *datagram; // WORK_DATAGRAM.
+};
+
+struct PendingDatagram {
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  std::string data;
+};
+
+/* Hot restart wire format, sent after the descriptors. Both ends run the same build. */
+struct HandoffHeader {
+  uint32_t magic;
+  uint32_t workers;   // Followed by 2 descriptors per worker, TCP listener then UDP.
+  uint32_t sessions;  // Number of HandoffSession records that follow.
+  uint32_t datagrams; // Number of HandoffDatagram records after those.
+  uint64_t ticketKey; // Tickets handed out before the restart stay good.
+};
+
+struct HandoffSession {
+  uint32_t worker;
+  uint32_t api;
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  uint64_t deadline; // CLOCK_MONOTONIC is system wide, so it survives the restart.
+  Assignment task;
+};
+
+struct HandoffDatagram {
+  uint32_t worker;
+  socklen_t addrLen;
+  struct sockaddr_storage addr;
+  uint32_t len;
+  char data[MAX_DATAGRAM];
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+// Hot restart coordination between the main thread and the workers.
+enum HandoffResult { HANDOFF_PENDING, HANDOFF_DONE, HANDOFF_FAILED };
+static std::atomic<bool> handoffRequested(false);
+static std::atomic<int> workersReleased(0);
+static std::atomic<int> handoffResult(HANDOFF_PENDING);
+static std::atomic<uint64_t> drainDeadline(0);
+
+static void onStopSignal(int) {
+  stopRequested = 1;
+}
+
+static void onDumpSignal(int) {
+  dumpRequested = 1;
+}
+
+static uint64_t monotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Resume tickets (codec.h) are the capability bitmap under a key drawn at
+   startup: a ticket from another server, or from before a cold restart,
+   gets a NAK and the client falls back to the list. The ticket names no
+   client, so the list is the same for every session and built once. */
+static uint64_t ticketKey;
+static std::string protocolList;
+
+static uint64_t capsTicket(uint32_t caps) {
+  uint64_t z = ticketKey ^ ((uint64_t)caps * 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void setTicketKey(uint64_t key) {
+  ticketKey = key;
+  char caps[64];
+  snprintf(caps, sizeof(caps), "CAPS %x %016llx\n\n", SERVER_CAPS, (unsigned long long)capsTicket(SERVER_CAPS));
+  protocolList = std::string(PROTOCOL_LIST) + caps;
+}
+
+static uint16_t peerPort(const struct sockaddr_storage &addr) {
+  if (addr.ss_family == AF_INET6) {
+    return ((const struct sockaddr_in6 *)&addr)->sin6_port;
+  }
+  return ((const struct sockaddr_in *)&addr)->sin_port;
+}
+
+static uint64_t realtimeNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static UdpPeer udpPeerOf(const struct sockaddr_storage &addr) {
+  UdpPeer peer;
+  peer.ip = ipKeyFromSockaddr((const struct sockaddr *)&addr);
+  peer.port = peerPort(addr);
+  return peer;
+}
+
+/* Draw a new assignment from calcLib and compute the reference result. */
+static Assignment newAssignment(uint32_t id) {
+  Assignment a;
+  const char *name = randomType();
+  const Operator *op = opByName(name, strlen(name));
+  if (op == NULL) {
+    op = &OPERATORS[0]; // calcLib knows an operator the protocol does not.
+  }
+  a.id = id;
+  a.arith = op->code;
+  a.value1 = randomInt();
+  a.value2 = randomInt();
+  if (!opSolve(op, a.value1, a.value2, &a.result)) {
+    a.value2 = 1; // div by 0; every operator is defined for x op 1.
+    opSolve(op, a.value1, a.value2, &a.result);
+  }
+  return a;
+}
+
+static std::string textAssignment(const Assignment &a) {
+  char line[MAX_LINE];
+  int n = snprintf(line, sizeof(line), "%s %d %d\n", opByCode(a.arith)->name, a.value1, a.value2);
+  return std::string(line, n);
+}
+
+static std::string binaryAssignment(const Assignment &a) {
+  ProtocolFields f = {1, 1, 1, a.id, a.arith, a.value1, a.value2, 0};
+  calcProtocol p = encodeProtocol(f);
+  return std::string((const char *)&p, sizeof(p));
+}
+
+static std::string binaryMessage(uint32_t message, uint16_t protocol) {
+  MessageFields f = {2, message, protocol, 1, 1};
+  calcMessage m = encodeMessage(f);
+  return std::string((const char *)&m, sizeof(m));
+}
+
+static bool checkBinaryAnswer(const char *data, size_t len, const Assignment &a) {
+  ProtocolFields f;
+  return decodeProtocol(data, len, &f) && f.type == 2 && f.id == a.id && f.result == a.result;
+}
+
+/* The hello that opens a UDP (or shared-memory) session. */
+static bool parseHello(const char *buf, size_t len, ApiType *api) {
+  MessageFields m;
+  if (decodeMessage(buf, len, &m)) {
+    if (m.type != 22 || m.message != 0 || m.protocol != 17 || m.major != 1) {
+      return false;
+    }
+    *api = API_BINARY;
+    return true;
+  }
+  if ((len == 13 && memcmp(buf, "TEXT UDP 1.1\n", 13) == 0) ||
+      (len == 12 && memcmp(buf, "TEXT UDP 1.1", 12) == 0)) {
+    *api = API_TEXT;
+    return true;
+  }
+  return false;
+}
+
+static bool checkAnswer(ApiType api, const char *buf, size_t len, const Assignment &a) {
+  if (api == API_BINARY) {
+    return checkBinaryAnswer(buf, len, a);
+  }
+  int32_t value;
+  return parseTextAnswer(buf, len, &value) && value == a.result;
+}
+
+static std::string verdict(ApiType api, bool ok, uint16_t protocol) {
+  if (api == API_BINARY) {
+    return binaryMessage(ok ? 1 : 2, protocol);
+  }
+  return ok ? "OK\n" : "ERROR\n";
+}
+
+/* Create a SO_REUSEPORT socket bound to host:port, so every worker gets its own. */
+static int openBoundSocket(const ServerConfig &cfg, int socktype) {
+  struct addrinfo hints, *res, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = socktype;
+  hints.ai_flags = AI_PASSIVE;
+  char portStr[16];
+  snprintf(portStr, sizeof(portStr), "%d", cfg.port);
+  int rv = getaddrinfo(cfg.host, portStr, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  int fd = -1;
+  for (rp = res; rp != NULL; rp = rp->ai_next) {
+    fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    perror("bind");
+    return -1;
+  }
+  if (socktype == SOCK_STREAM && listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* The CPU worker <i> runs on, -1 if it is not pinned. */
+static int workerCpu(const ServerConfig &cfg, int i) {
+  if (cfg.numa) {
+    return topologyPlace(*cfg.topology, i + 1)[i];
+  }
+  if (cfg.pinCpu >= 0 || cfg.busyPoll) {
+    return (cfg.pinCpu >= 0 ? cfg.pinCpu : 0) + i;
+  }
+  return -1;
+}
+
+/* The node of that CPU under --numa, else -1. */
+static int workerNode(const ServerConfig &cfg, int i) {
+  return cfg.numa ? cfg.topology->nodeOf[workerCpu(cfg, i)] : -1;
+}
+
+class Worker {
+public:
+  // Created with new (workerNode(cfg, i)) Worker(cfg, i), in pages of its node.
+  static void *operator new(size_t size, int node) {
+    void *p = topologyAlloc(size, node);
+    if (p == NULL) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+  static void operator delete(void *p, size_t size) { topologyFree(p, size); }
+  // Called instead when the constructor throws.
+  static void operator delete(void *p, int) { topologyFree(p, sizeof(Worker)); }
+
+  Worker(const ServerConfig &config, int workerIndex)
+    : cfg(config), index(workerIndex), cpu(workerCpu(config, workerIndex)), node(workerNode(config, workerIndex)),
+      epfd(-1), listenFd(-1), udpFd(-1), shmListenFd(-1),
+      udpWriteArmed(false), shmSpinning(false), released(false), stopping(false), nextId(1), nextSerial(1),
+      lastSweep(0), datagramsAllocated(0) {
+    tcpStats.sessions = tcpStats.writes = tcpStats.resumed = tcpStats.slowReaders = 0;
+    memset(&output, 0, sizeof(output));
+    arrivals.local = arrivals.remote = 0;
+    admission.configure(cfg.maxSessions, cfg.maxPerIp, cfg.rate, cfg.burst);
+    sched.configure(cfg.schedQuantum);
+  }
+
+  ~Worker() {
+    for (size_t i = 0; i < datagramPool.size(); i++) {
+      delete datagramPool[i];
+    }
+  }
+
+  bool open() {
+    return adopt(openBoundSocket(cfg, SOCK_STREAM), openBoundSocket(cfg, SOCK_DGRAM));
+  }
+
+  /* Use sockets that are already bound, e.g. handed over by the old process. */
+  bool adopt(int tcpListener, int udpSocket) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    listenFd = tcpListener;
+    udpFd = udpSocket;
+    if (epfd < 0 || listenFd < 0 || udpFd < 0) {
+      return false;
+    }
+    if (cfg.busyPoll) {
+      enableBusyPoll();
+    }
+    if (cfg.numa) {
+      steerFlows();
+    }
+    // Accepted connections inherit it, so sessions need no setsockopt() of their own.
+    int nodelay = cfg.coalesce ? 1 : 0;
+    setsockopt(listenFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    watchSockets();
+    if (cfg.sessionLogDir != NULL && !sessionLog.open(cfg.sessionLogDir, index, cfg.sessionLogRecords)) {
+      return false;
+    }
+    return openShm();
+  }
+
+  void run() {
+    struct epoll_event events[EVENTS_PER_WAIT];
+    if (cpu >= 0) {
+      pinToCpu(cpu);
+    }
+    if (node >= 0 && !topologyPreferNode(node)) {
+      fprintf(stderr, "worker %d: memory not bound to node %d: %s\n", index, node, strerror(errno));
+    }
+    coroSetOutputLimit((cfg.outputPool + CORO_CHUNK_SIZE - 1) / CORO_CHUNK_SIZE);
+    bool spinning = cfg.busyPoll;
+    uint64_t lastDatagram = monotonicNs();
+    setShmSpinning(spinning);
+    while (!stopRequested && !stopping.load(std::memory_order_relaxed)) {
+      if (!stepHandoff()) {
+        break;
+      }
+      if (spinning) {
+        // Busy poll: read UDP and the rings directly, then pick up TCP work without sleeping.
+        int handled = pollShm();
+        if (!released) {
+          handled += onUdpReadable();
+        }
+        if (handled > 0) {
+          lastDatagram = monotonicNs();
+        } else if (monotonicNs() - lastDatagram > (uint64_t)cfg.busyPollIdleUs * 1000ULL) {
+          spinning = false;
+          setShmSpinning(false);
+        }
+      }
+      int n = epoll_wait(epfd, events, EVENTS_PER_WAIT, spinning || !sched.empty() ? 0 : 100);
+      if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        void *tag = events[i].data.ptr;
+        if (tag == &listenFd) {
+          onAccept();
+        } else if (tag == &shmListenFd) {
+          onShmAccept();
+        } else if (tag == &udpFd) {
+          if (events[i].events & EPOLLOUT) {
+            flushUdp();
+          }
+          if ((events[i].events & EPOLLIN) && onUdpReadable() > 0 && cfg.busyPoll) {
+            // Traffic is back, start spinning again.
+            spinning = true;
+            setShmSpinning(true);
+            lastDatagram = monotonicNs();
+          }
+        } else {
+          EpollTag *t = (EpollTag *)tag;
+          if (t->source == SOURCE_TCP) {
+            scheduleTcp((TcpSession *)t->owner, events[i].events);
+          } else if (t->source == SOURCE_SHM_CONTROL) {
+            closeShm((ShmSession *)t->owner);
+          } else if (onShmReady((ShmSession *)t->owner) > 0 && cfg.busyPoll && !spinning) {
+            spinning = true;
+            setShmSpinning(true);
+            lastDatagram = monotonicNs();
+          }
+        }
+      }
+      runScheduled();
+      sweepTimeouts();
+      outbox.flush();
+    }
+    shutdownAll();
+    sessionLog.close();
+    output = coroOutputStats();
+  }
+
+  /* Make run() return after its current iteration, e.g. between self-bench rounds. */
+  void stop() {
+    stopping.store(true, std::memory_order_relaxed);
+  }
+
+  /* Hot restart, successor side: UDP state that the old process handed over. */
+  void restoreSession(const HandoffSession &h) {
+    UdpPeer peer;
+    peer.ip = ipKeyFromSockaddr((const struct sockaddr *)&h.addr);
+    peer.port = peerPort(h.addr);
+    UdpSession &s = udpSessions[peer];
+    memcpy(&s.addr, &h.addr, sizeof(s.addr));
+    s.addrLen = h.addrLen;
+    s.api = (ApiType)h.api;
+    s.started = monotonicNs();
+    s.deadline = h.deadline;
+    s.task = h.task;
+    s.traceId = 0;
+    s.phaseStart = 0;
+    admission.admitExisting(peer.ip);
+    if (h.task.id >= nextId) {
+      nextId = h.task.id + 1;
+    }
+  }
+
+  void restoreDatagram(const HandoffDatagram &h) {
+    PendingDatagram d;
+    memcpy(&d.addr, &h.addr, sizeof(d.addr));
+    d.addrLen = h.addrLen;
+    d.data.assign(h.data, h.len);
+    udpPending.push_back(d);
+    updateUdpInterest();
+  }
+
+  /* Hot restart, old side: what the main thread sends to the successor. Only
+     valid once this worker has released its sockets. */
+  int tcpListener() const { return listenFd; }
+  int udpSocket() const { return udpFd; }
+  const std::vector<HandoffSession> &releasedSessions() const { return handoffSessions; }
+  const std::vector<HandoffDatagram> &releasedDatagrams() const { return handoffDatagrams; }
+
+  void printStats() const {
+    printf("worker %d: admitted %llu, rejected full %llu, per-ip %llu, rate %llu\n", index,
+           (unsigned long long)admission.stats.admitted,
+           (unsigned long long)admission.stats.rejectedFull,
+           (unsigned long long)admission.stats.rejectedPerIp,
+           (unsigned long long)admission.stats.rejectedRate);
+    printf("worker %d: tcp sessions %llu (%llu resumed), write calls %llu (%.2f per session)\n", index,
+           (unsigned long long)tcpStats.sessions, (unsigned long long)tcpStats.resumed,
+           (unsigned long long)tcpStats.writes, tcpStats.sessions ? (double)tcpStats.writes / tcpStats.sessions : 0.0);
+    printf("worker %d: tcp output peak %zu of %zu bytes, refused %llu sends, dropped %llu slow readers\n", index,
+           output.peak * CORO_CHUNK_SIZE, cfg.outputPool, (unsigned long long)output.refused,
+           (unsigned long long)tcpStats.slowReaders);
+    if (cfg.numa) {
+      printf("worker %d: cpu %d, node %d\n", index, cpu, node);
+    }
+    if (cfg.numaStats) {
+      uint64_t total = arrivals.local + arrivals.remote;
+      printf("worker %d: %llu of %llu arrivals (TCP connections, UDP reads) processed on another node (%.1f%%)\n",
+             index, (unsigned long long)arrivals.remote, (unsigned long long)total,
+             total ? 100.0 * arrivals.remote / total : 0.0);
+    }
+    printf("worker %d: scheduled %llu work items, peak queue %zu, %llu iterations left work for the next\n",
+           index, (unsigned long long)sched.stats.ran, sched.stats.peak, (unsigned long long)sched.stats.carried);
+    if (cfg.sessionLogDir != NULL) {
+      printf("worker %d: session log %llu records, %llu segments sealed, %llu dropped\n", index,
+             (unsigned long long)sessionLog.written, (unsigned long long)sessionLog.segments,
+             (unsigned long long)sessionLog.dropped);
+    }
+    std::vector<ClientLatencySummary> clients = latency.summaries();
+    if (clients.empty()) {
+      return;
+    }
+    printf("worker %d: session p99 over %zu clients: min %.0f us, median %.0f us, max %.0f us\n", index,
+           clients.size(), clients.back().p99 / 1e3, clients[clients.size() / 2].p99 / 1e3, clients[0].p99 / 1e3);
+    for (size_t i = 0; i < clients.size() && i < 5; i++) {
+      char ip[INET6_ADDRSTRLEN];
+      ipKeyFormat(clients[i].client, ip, sizeof(ip));
+      printf("worker %d:   %s: %llu sessions, p50 %.0f us, p99 %.0f us, max %.0f us\n", index, ip,
+             (unsigned long long)clients[i].count, clients[i].p50 / 1e3, clients[i].p99 / 1e3, clients[i].max / 1e3);
+    }
+  }
+
+#ifdef FUZZ
+  /* One fuzz input (make fuzz): all of <data> as what a client sends on a TCP
+     connection, here one end of a socketpair, then the same bytes cut at
+     <cut> into two datagrams from one UDP peer. Shuts the worker down. */
+  void fuzzInput(const char *data, size_t len, size_t cut) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) == 0) {
+      // What does not fit in the socket buffer is lost, as if the client stopped.
+      ssize_t sent = write(sv[1], data, len);
+      (void)sent;
+      shutdown(sv[1], SHUT_WR);
+      IpKey ip = SHM_CLIENT;
+      uint64_t now = monotonicNs();
+      admission.admit(ip, now);
+      serveTcp(sv[0], ip, now);
+      struct epoll_event events[EVENTS_PER_WAIT];
+      char sink[4096];
+      for (int round = 0; round < 64 && !tcpSessions.empty(); round++) {
+        int n = epoll_wait(epfd, events, EVENTS_PER_WAIT, 0);
+        for (int i = 0; i < n; i++) {
+          void *tag = events[i].data.ptr;
+          if (tag != &listenFd && tag != &udpFd && ((EpollTag *)tag)->source == SOURCE_TCP) {
+            scheduleTcp((TcpSession *)((EpollTag *)tag)->owner, events[i].events);
+          }
+        }
+        runAll();
+        outbox.flush();
+        while (read(sv[1], sink, sizeof(sink)) > 0) {
+        }
+      }
+      close(sv[1]);
+    }
+
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(5555);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    handleDatagram(data, cut, addr, sizeof(*in), monotonicNs());
+    handleDatagram(data + cut, len - cut, addr, sizeof(*in), monotonicNs());
+    shutdownAll();
+  }
+#endif
+
+private:
+  void pinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % CPU_SETSIZE, &set);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rv != 0) {
+      fprintf(stderr, "worker %d: cannot pin to cpu %d: %s\n", index, cpu, strerror(rv));
+    }
+  }
+
+  /* Ask the kernel to busy poll the device queue under our recvmmsg() calls.
+     Values above net.core.busy_poll need CAP_NET_ADMIN, so failures are
+     reported but not fatal; spinning on recvmmsg() still saves the wakeups. */
+  void enableBusyPoll() {
+    int usec = 50;
+    int one = 1;
+    int budget = DATAGRAMS_PER_WAKE;
+    if (setsockopt(udpFd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 ||
+        setsockopt(udpFd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0 ||
+        setsockopt(udpFd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0) {
+      fprintf(stderr, "worker %d: kernel busy poll not enabled: %s\n", index, strerror(errno));
+    }
+  }
+
+  /* Ask SO_REUSEPORT for the flows whose packets are processed on our CPU. */
+  void steerFlows() {
+    if (setsockopt(listenFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0 ||
+        setsockopt(udpFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+      fprintf(stderr, "worker %d: SO_INCOMING_CPU: %s\n", index, strerror(errno));
+    }
+  }
+
+  /* --numa-stats: was the last packet on <fd> processed on this worker's node? */
+  void countArrival(int fd) {
+    int in = -1;
+    socklen_t len = sizeof(in);
+    int here = sched_getcpu();
+    const std::vector<int> &nodeOf = cfg.topology->nodeOf;
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &in, &len) < 0 || in < 0 || here < 0 ||
+        in >= (int)nodeOf.size() || here >= (int)nodeOf.size()) {
+      return;
+    }
+    if (nodeOf[in] == nodeOf[here]) {
+      arrivals.local++;
+    } else {
+      arrivals.remote++;
+    }
+  }
+
+  void watchSockets() {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev);
+    ev.events = udpPending.empty() ? EPOLLIN : EPOLLOUT;
+    ev.data.ptr = &udpFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, udpFd, &ev);
+    udpWriteArmed = !udpPending.empty();
+  }
+
+  /*
+     Follow the main thread through a hot restart. When a handoff is requested
+     the worker stops accepting and stops reading UDP, and moves its UDP
+     sessions and queued datagrams out for the successor. If the handoff fails
+     everything is put back; if it succeeds the worker keeps serving its TCP
+     sessions until they are done or the drain deadline passes. Returns false
+     when the worker should exit.
+  */
+  bool stepHandoff() {
+    if (!released) {
+      // Not again while a failed handoff is still being unwound.
+      if (handoffRequested.load(std::memory_order_acquire) &&
+          handoffResult.load(std::memory_order_acquire) == HANDOFF_PENDING) {
+        releaseSockets();
+      }
+      return true;
+    }
+    int result = handoffResult.load(std::memory_order_acquire);
+    if (result == HANDOFF_FAILED || !handoffRequested.load(std::memory_order_acquire)) {
+      reclaimSockets();
+      return true;
+    }
+    if (result == HANDOFF_DONE) {
+      // The successor serves the UDP sessions now; expiring them here would log
+      // them as abandoned.
+      if (!udpSessions.empty() || !udpPending.empty()) {
+        udpSessions.clear();
+        udpPending.clear();
+      }
+      uint64_t deadline = drainDeadline.load(std::memory_order_acquire);
+      return !((tcpSessions.empty() && shmSessions.empty()) || monotonicNs() > deadline);
+    }
+    return true;
+  }
+
+  void releaseSockets() {
+    // Queued datagrams and accepted connections are served here, not handed over.
+    runAll();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, listenFd, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, udpFd, NULL);
+    // Channels are not handed over, the successor binds the name again and
+    // clients reconnect once their channel is drained.
+    closeShmListener();
+    flushUdp();
+    handoffSessions.clear();
+    handoffDatagrams.clear();
+    for (std::unordered_map<UdpPeer, UdpSession, UdpPeerHash>::iterator it = udpSessions.begin(); it != udpSessions.end(); ++it) {
+      HandoffSession h;
+      memset(&h, 0, sizeof(h));
+      h.worker = index;
+      h.api = it->second.api;
+      memcpy(&h.addr, &it->second.addr, sizeof(h.addr));
+      h.addrLen = it->second.addrLen;
+      h.deadline = it->second.deadline;
+      h.task = it->second.task;
+      handoffSessions.push_back(h);
+    }
+    for (size_t i = 0; i < udpPending.size(); i++) {
+      HandoffDatagram h;
+      memset(&h, 0, sizeof(h));
+      h.worker = index;
+      memcpy(&h.addr, &udpPending[i].addr, sizeof(h.addr));
+      h.addrLen = udpPending[i].addrLen;
+      h.len = udpPending[i].data.size();
+      memcpy(h.data, udpPending[i].data.data(), h.len);
+      handoffDatagrams.push_back(h);
+    }
+    released = true;
+    workersReleased.fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  /* The handoff failed, keep serving as if nothing happened. The UDP state was
+     only copied, so re-registering the sockets is enough. */
+  void reclaimSockets() {
+    handoffSessions.clear();
+    handoffDatagrams.clear();
+    udpWriteArmed = false;
+    watchSockets();
+    openShm();
+    released = false;
+    workersReleased.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  void onAccept() {
+    for (int i = 0; i < ACCEPTS_PER_WAKE; i++) {
+      struct sockaddr_storage addr;
+      socklen_t addrLen = sizeof(addr);
+      int fd = accept4(listenFd, (struct sockaddr *)&addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+          perror("accept");
+        }
+        return;
+      }
+      if (cfg.numaStats) {
+        countArrival(fd);
+      }
+      IpKey ip = ipKeyFromSockaddr((struct sockaddr *)&addr);
+      uint64_t now = monotonicNs();
+      if (admission.admit(ip, now) != ADMIT_OK) {
+        // Early rejection, no session state exists yet.
+        close(fd);
+        continue;
+      }
+      WorkItem w;
+      memset(&w, 0, sizeof(w));
+      w.kind = WORK_TCP_START;
+      w.fd = fd;
+      w.ip = ip;
+      w.at = now;
+      sched.push(ip, SCHED_NEW, w);
+    }
+  }
+
+  void scheduleTcp(TcpSession *s, uint32_t events) {
+    s->readyEvents |= events;
+    if (s->scheduled) {
+      return;
+    }
+    s->scheduled = true;
+    WorkItem w;
+    memset(&w, 0, sizeof(w));
+    w.kind = WORK_TCP_STEP;
+    w.fd = s->conn.fd();
+    w.serial = s->serial;
+    sched.push(s->ip, s->assigned ? SCHED_ACTIVE : SCHED_NEW, w);
+  }
+
+  /* This iteration's share of the queued work, see scheduler.h. */
+  void runScheduled() {
+    sched.run(cfg.schedBudget, [this](const WorkItem &w) { runWork(w); });
+  }
+
+  void runAll() {
+    sched.run(0, [this](const WorkItem &w) { runWork(w); });
+  }
+
+  void runWork(const WorkItem &w) {
+    if (w.kind == WORK_TCP_START) {
+      serveTcp(w.fd, w.ip, w.at);
+    } else if (w.kind == WORK_TCP_STEP) {
+      std::unordered_map<int, TcpSession *>::iterator it = tcpSessions.find(w.fd);
+      if (it == tcpSessions.end() || it->second->serial != w.serial) {
+        return; // The session ended while the step waited.
+      }
+      TcpSession *s = it->second;
+      uint32_t events = s->readyEvents;
+      s->readyEvents = 0;
+      s->scheduled = false;
+      s->conn.onEvents(events);
+    } else {
+      QueuedDatagram *d = w.datagram;
+      handleDatagram(d->data, d->len, d->addr, d->addrLen, d->readAt);
+      datagramPool.push_back(d);
+    }
+  }
+
+  /* Shutdown: what never ran is dropped. */
+  void dropWork(const WorkItem &w) {
+    if (w.kind == WORK_TCP_START) {
+      close(w.fd);
+      admission.release(w.ip);
+    } else if (w.kind == WORK_DATAGRAM) {
+      datagramPool.push_back(w.datagram);
+    }
+  }
+
+  /* One TCP session, start to end. It runs until it has to wait for the
+     client and is resumed by onEvents() from the loop, or by cancel() from
+     sweepTimeouts(). */
+  CoroTask serveTcp(int fd, IpKey ip, uint64_t acceptedAt) {
+    TcpSession s;
+    s.tag.source = SOURCE_TCP;
+    s.tag.owner = &s;
+    s.ip = ip;
+    s.deadline = acceptedAt + (uint64_t)cfg.sessionTimeoutMs * 1000000ULL;
+    s.serial = nextSerial++;
+    s.started = acceptedAt;
+    s.readyEvents = 0;
+    s.scheduled = false;
+    s.assigned = false;
+    // Backpressure: a client that does not read what we owe it is not read either.
+    s.conn.highWater = cfg.sendHighWater;
+    s.conn.lowWater = cfg.sendLowWater;
+    s.conn.attach(epfd, fd, &s.tag, false, cfg.coalesce ? &outbox : NULL);
+    tcpSessions[fd] = &s;
+
+    uint32_t traceId = traceBegin();
+    ApiType api = API_TEXT;
+    Assignment task;
+    bool ok = false;
+    uint64_t t0 = traceNow();
+    do {
+      // A returning client may have sent a resume frame already; then it
+      // gets no list unless its ticket is refused.
+      uint64_t phaseStart = t0;
+      int first = s.conn.peekNow();
+      bool listed = first != CAPS_RESUME_MARKER;
+      if (listed) {
+        if (!co_await s.conn.send(protocolList.data(), protocolList.size())) {
+          break;
+        }
+        phaseStart = traceNow();
+        traceSpan(traceId, TRACE_PROTOCOL_LIST, t0, phaseStart);
+        first = co_await s.conn.peek();
+      }
+
+      std::string line;
+      bool resumed = false;
+      if (first == CAPS_RESUME_MARKER) {
+        char frame[CAPS_RESUME_LEN];
+        uint32_t choice;
+        uint64_t ticket;
+        if (co_await s.conn.recvFrame(frame, sizeof(frame)) < 0 || !decodeResume(frame, sizeof(frame), &choice, &ticket)) {
+          break;
+        }
+        resumed = ticket == capsTicket(SERVER_CAPS) && (choice == CAPS_TEXT_TCP || choice == CAPS_BINARY_TCP);
+        if (resumed) {
+          api = choice == CAPS_TEXT_TCP ? API_TEXT : API_BINARY;
+          tcpStats.resumed++;
+        } else {
+          std::string refusal(1, (char)CAPS_NAK);
+          if (!listed) {
+            refusal += protocolList;
+          }
+          if (!co_await s.conn.send(refusal.data(), refusal.size())) {
+            break;
+          }
+        }
+      }
+      if (!resumed) {
+        if (!co_await s.conn.recvLine(&line, MAX_LINE)) {
+          break;
+        }
+        if (line == "TEXT TCP 1.1 OK") {
+          api = API_TEXT;
+        } else if (line == "BINARY TCP 1.1 OK") {
+          api = API_BINARY;
+        } else {
+          break;
+        }
+      }
+      t0 = traceNow();
+      traceSpan(traceId, TRACE_CHOICE, phaseStart, t0);
+      task = newAssignment(nextId++);
+      s.assigned = true;
+      std::string msg = api == API_TEXT ? textAssignment(task) : binaryAssignment(task);
+      if (resumed) {
+        msg.insert(msg.begin(), (char)CAPS_ACK); // Goes out with the assignment.
+      }
+      if (!co_await s.conn.send(msg.data(), msg.size())) {
+        break;
+      }
+      phaseStart = traceNow();
+      traceSpan(traceId, TRACE_ASSIGNMENT, t0, phaseStart);
+
+      if (api == API_TEXT) {
+        if (!co_await s.conn.recvLine(&line, MAX_LINE)) {
+          break;
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, phaseStart, t0);
+        int32_t value;
+        ok = parseTextAnswer(line.data(), line.size(), &value) && value == task.result;
+      } else {
+        char answer[sizeof(calcProtocol)];
+        if (co_await s.conn.recvFrame(answer, sizeof(answer)) < 0) {
+          break;
+        }
+        t0 = traceNow();
+        traceSpan(traceId, TRACE_ANSWER, phaseStart, t0);
+        ok = checkBinaryAnswer(answer, sizeof(answer), task);
+      }
+      traceSpan(traceId, TRACE_VERIFY, t0, traceNow());
+    } while (false);
+
+    // A bad choice, an overlong line or a wrong answer gets a verdict; a broken,
+    // timed out or cancelled connection is just closed.
+    if (!s.conn.failed()) {
+      t0 = traceNow();
+      std::string msg = verdict(api, ok, 6);
+      if (!cfg.coalesce) {
+        if (co_await s.conn.send(msg.data(), msg.size())) {
+          co_await s.conn.flush();
+        }
+      } else {
+        co_await s.conn.sendLast(msg.data(), msg.size());
+      }
+      traceSpan(traceId, TRACE_RESULT, t0, traceNow());
+      uint64_t elapsed = monotonicNs() - s.started;
+      latency.record(ip, elapsed);
+      if (s.assigned) {
+        logSession(LOG_TCP, api, ip, task, ok ? LOG_CORRECT : LOG_WRONG, elapsed);
+      }
+    } else if (s.assigned) {
+      logSession(LOG_TCP, api, ip, task, LOG_ABANDONED, monotonicNs() - s.started);
+    }
+    tcpStats.sessions++;
+    tcpStats.writes += s.conn.writes();
+    tcpSessions.erase(fd);
+    admission.release(ip);
+    s.conn.close();
+  }
+
+  /* Read a batch of datagrams with one recvmmsg() into the scheduler's queue.
+     Returns how many were read. */
+  int onUdpReadable() {
+    if (!udpPending.empty()) {
+      return 0; // Backpressure, see updateUdpInterest().
+    }
+    int room = UDP_QUEUE_MAX - (int)(datagramsAllocated - datagramPool.size());
+    int want = room < DATAGRAMS_PER_WAKE ? room : DATAGRAMS_PER_WAKE;
+    if (want <= 0) {
+      return 0; // The scheduler is behind, the rest waits in the socket buffer.
+    }
+    QueuedDatagram *bufs[DATAGRAMS_PER_WAKE];
+    struct mmsghdr msgs[DATAGRAMS_PER_WAKE];
+    struct iovec iovs[DATAGRAMS_PER_WAKE];
+    for (int i = 0; i < want; i++) {
+      if (datagramPool.empty()) {
+        datagramPool.push_back(new QueuedDatagram());
+        datagramsAllocated++;
+      }
+      bufs[i] = datagramPool.back();
+      datagramPool.pop_back();
+      iovs[i].iov_base = bufs[i]->data;
+      iovs[i].iov_len = MAX_DATAGRAM;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &bufs[i]->addr;
+      msgs[i].msg_hdr.msg_namelen = sizeof(bufs[i]->addr);
+    }
+    int n = recvmmsg(udpFd, msgs, want, MSG_DONTWAIT, NULL);
+    uint64_t now = monotonicNs();
+    if (n > 0 && cfg.numaStats) {
+      countArrival(udpFd);
+    }
+    for (int i = 0; i < want; i++) {
+      if (i >= n) {
+        datagramPool.push_back(bufs[i]);
+        continue;
+      }
+      QueuedDatagram *d = bufs[i];
+      d->addrLen = msgs[i].msg_hdr.msg_namelen;
+      d->len = msgs[i].msg_len;
+      d->readAt = now;
+      UdpPeer peer = udpPeerOf(d->addr);
+      WorkItem w;
+      memset(&w, 0, sizeof(w));
+      w.kind = WORK_DATAGRAM;
+      w.datagram = d;
+      sched.push(peer.ip, udpSessions.count(peer) ? SCHED_ACTIVE : SCHED_NEW, w);
+    }
+    return n > 0 ? n : 0;
+  }
+
+  void handleDatagram(const char *buf, size_t len, const struct sockaddr_storage &addr, socklen_t addrLen,
+                      uint64_t readAt) {
+    uint64_t t0 = traceNow();
+    UdpPeer peer = udpPeerOf(addr);
+
+    std::unordered_map<UdpPeer, UdpSession, UdpPeerHash>::iterator it = udpSessions.find(peer);
+    if (it != udpSessions.end()) {
+      UdpSession &s = it->second;
+      ApiType again;
+      if (parseHello(buf, len, &again) && again == s.api) {
+        // The client lost the assignment and retried, it gets the same one.
+        std::string msg = s.api == API_TEXT ? textAssignment(s.task) : binaryAssignment(s.task);
+        sendUdp(addr, addrLen, msg.data(), msg.size());
+        return;
+      }
+      traceSpan(s.traceId, TRACE_ANSWER, s.phaseStart, t0);
+      bool ok = checkAnswer(s.api, buf, len, s.task);
+      uint64_t t1 = traceNow();
+      traceSpan(s.traceId, TRACE_VERIFY, t0, t1);
+      std::string msg = verdict(s.api, ok, 17);
+      sendUdp(addr, addrLen, msg.data(), msg.size());
+      traceSpan(s.traceId, TRACE_RESULT, t1, traceNow());
+      uint64_t elapsed = monotonicNs() - s.started;
+      latency.record(peer.ip, elapsed);
+      logSession(LOG_UDP, s.api, peer.ip, s.task, ok ? LOG_CORRECT : LOG_WRONG, elapsed);
+      udpSessions.erase(it);
+      admission.release(peer.ip);
+      return;
+    }
+
+    ApiType api;
+    if (!parseHello(buf, len, &api)) {
+      rejectUdp(addr, addrLen);
+      return;
+    }
+
+    if (admission.admit(peer.ip, monotonicNs()) != ADMIT_OK) {
+      // Reject before any assignment state is allocated.
+      rejectUdp(addr, addrLen);
+      return;
+    }
+
+    UdpSession &s = udpSessions[peer];
+    memcpy(&s.addr, &addr, addrLen);
+    s.addrLen = addrLen;
+    s.api = api;
+    s.started = readAt;
+    s.deadline = monotonicNs() + (uint64_t)UDP_TIMEOUT_MS * 1000000ULL;
+    s.traceId = traceBegin();
+    uint64_t t1 = traceNow();
+    traceSpan(s.traceId, TRACE_CHOICE, t0, t1);
+    s.task = newAssignment(nextId++);
+    std::string msg = api == API_TEXT ? textAssignment(s.task) : binaryAssignment(s.task);
+    sendUdp(addr, addrLen, msg.data(), msg.size());
+    s.phaseStart = traceNow();
+    traceSpan(s.traceId, TRACE_ASSIGNMENT, t1, s.phaseStart);
+  }
+
+  void rejectUdp(const struct sockaddr_storage &addr, socklen_t addrLen) {
+    std::string msg = binaryMessage(2, 17);
+    sendUdp(addr, addrLen, msg.data(), msg.size());
+  }
+
+  void sendUdp(const struct sockaddr_storage &addr, socklen_t addrLen, const char *data, size_t len) {
+    if (udpPending.empty()) {
+      ssize_t n = sendto(udpFd, data, len, 0, (const struct sockaddr *)&addr, addrLen);
+      if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return;
+      }
+    }
+    if (udpPending.size() >= UDP_PENDING_MAX) {
+      return; // It is UDP, the client will time out and retry.
+    }
+    PendingDatagram d;
+    memcpy(&d.addr, &addr, addrLen);
+    d.addrLen = addrLen;
+    d.data.assign(data, len);
+    udpPending.push_back(d);
+    updateUdpInterest();
+  }
+
+  void flushUdp() {
+    while (!udpPending.empty()) {
+      PendingDatagram &d = udpPending.front();
+      ssize_t n = sendto(udpFd, d.data.data(), d.data.size(), 0, (struct sockaddr *)&d.addr, d.addrLen);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      udpPending.pop_front();
+    }
+    updateUdpInterest();
+  }
+
+  /* While replies are queued the UDP socket is write-only, so we stop taking
+     new work until the send buffer has room again. */
+  void updateUdpInterest() {
+    bool wantWrite = !udpPending.empty();
+    if (wantWrite == udpWriteArmed) {
+      return;
+    }
+    struct epoll_event ev;
+    ev.events = wantWrite ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = &udpFd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, udpFd, &ev);
+    udpWriteArmed = wantWrite;
+  }
+
+  bool openShm() {
+    if (cfg.shmName == NULL || index != 0) {
+      return true;
+    }
+    shmListenFd = shmListen(cfg.shmName);
+    if (shmListenFd < 0) {
+      return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shmListenFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, shmListenFd, &ev);
+    return true;
+  }
+
+  void closeShmListener() {
+    if (shmListenFd >= 0) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, shmListenFd, NULL);
+      close(shmListenFd);
+      shmListenFd = -1;
+    }
+  }
+
+  /* A client hands us a channel. The setup is a short blocking exchange on
+     the unix socket, bounded by a receive timeout in shmAccept(). */
+  void onShmAccept() {
+    ShmEndpoint ep;
+    int controlFd = shmAccept(shmListenFd, &ep);
+    if (controlFd < 0) {
+      return;
+    }
+    if (admission.admit(SHM_CLIENT, monotonicNs()) != ADMIT_OK) {
+      shmClose(&ep);
+      close(controlFd);
+      return;
+    }
+    fcntl(controlFd, F_SETFL, O_NONBLOCK);
+    ShmSession *s = new ShmSession();
+    s->ringTag.source = SOURCE_SHM_RING;
+    s->ringTag.owner = s;
+    s->controlTag.source = SOURCE_SHM_CONTROL;
+    s->controlTag.owner = s;
+    s->controlFd = controlFd;
+    s->ep = ep;
+    s->active = false;
+    s->traceId = 0;
+    shmSetWaiting(&s->ep, !shmSpinning);
+    shmSessions.push_back(s);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s->ringTag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->ep.inEvent, &ev);
+    // The client never writes to the socket again, readable means it is gone.
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = &s->controlTag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, controlFd, &ev);
+    onShmReady(s);
+  }
+
+  /* Handle the frames waiting in a channel. Returns how many were handled. */
+  int onShmReady(ShmSession *s) {
+    shmDrainEvent(&s->ep);
+    char buf[SHM_MAX_FRAME];
+    for (int i = 0; i < DATAGRAMS_PER_WAKE; i++) {
+      int n = shmTryRecv(&s->ep, buf, sizeof(buf));
+      if (n == 0) {
+        return i;
+      }
+      if (n < 0 || !handleShmFrame(s, buf, n)) {
+        closeShm(s);
+        return i;
+      }
+    }
+    // Leave the rest for the next round, but make sure there is one.
+    uint64_t one = 1;
+    if (write(s->ep.inEvent, &one, sizeof(one)) < 0) {
+      perror("shm eventfd");
+    }
+    return DATAGRAMS_PER_WAKE;
+  }
+
+  int pollShm() {
+    int handled = 0;
+    for (size_t i = 0; i < shmSessions.size();) {
+      ShmSession *s = shmSessions[i];
+      handled += onShmReady(s);
+      if (i < shmSessions.size() && shmSessions[i] == s) {
+        i++;
+      }
+    }
+    return handled;
+  }
+
+  /* Tell the clients whether we poll their rings or need an eventfd wakeup. */
+  void setShmSpinning(bool spinning) {
+    shmSpinning = spinning;
+    for (size_t i = 0; i < shmSessions.size(); i++) {
+      shmSetWaiting(&shmSessions[i]->ep, !spinning);
+    }
+    if (!spinning) {
+      // A frame pushed just before a client saw the flag has no wakeup.
+      pollShm();
+    }
+  }
+
+  /* One frame of the UDP session flow. Returns false if the channel must go. */
+  bool handleShmFrame(ShmSession *s, const char *buf, size_t len) {
+    uint64_t t0 = traceNow();
+    if (s->active) {
+      traceSpan(s->traceId, TRACE_ANSWER, s->phaseStart, t0);
+      bool ok = checkAnswer(s->api, buf, len, s->task);
+      uint64_t t1 = traceNow();
+      traceSpan(s->traceId, TRACE_VERIFY, t0, t1);
+      s->active = false;
+      std::string msg = verdict(s->api, ok, 17);
+      bool sent = shmSend(&s->ep, msg.data(), msg.size());
+      traceSpan(s->traceId, TRACE_RESULT, t1, traceNow());
+      logSession(LOG_SHM, s->api, SHM_CLIENT, s->task, ok ? LOG_CORRECT : LOG_WRONG, monotonicNs() - s->started);
+      return sent;
+    }
+    if (!parseHello(buf, len, &s->api)) {
+      std::string msg = binaryMessage(2, 17);
+      return shmSend(&s->ep, msg.data(), msg.size());
+    }
+    s->active = true;
+    s->started = monotonicNs();
+    s->deadline = s->started + (uint64_t)UDP_TIMEOUT_MS * 1000000ULL;
+    s->traceId = traceBegin();
+    uint64_t t1 = traceNow();
+    traceSpan(s->traceId, TRACE_CHOICE, t0, t1);
+    s->task = newAssignment(nextId++);
+    std::string msg = s->api == API_TEXT ? textAssignment(s->task) : binaryAssignment(s->task);
+    // The client waits for each reply, so a full ring means it is misbehaving.
+    if (!shmSend(&s->ep, msg.data(), msg.size())) {
+      return false;
+    }
+    s->phaseStart = traceNow();
+    traceSpan(s->traceId, TRACE_ASSIGNMENT, t1, s->phaseStart);
+    return true;
+  }
+
+  void closeShm(ShmSession *s) {
+    if (s->active) {
+      logSession(LOG_SHM, s->api, SHM_CLIENT, s->task, LOG_ABANDONED, monotonicNs() - s->started);
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->ep.inEvent, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->controlFd, NULL);
+    shmClose(&s->ep);
+    close(s->controlFd);
+    for (size_t i = 0; i < shmSessions.size(); i++) {
+      if (shmSessions[i] == s) {
+        shmSessions[i] = shmSessions.back();
+        shmSessions.pop_back();
+        break;
+      }
+    }
+    admission.release(SHM_CLIENT);
+    delete s;
+  }
+
+  void sweepTimeouts() {
+    uint64_t now = monotonicNs();
+    if (now - lastSweep < 100000000ULL) {
+      return;
+    }
+    lastSweep = now;
+    std::vector<TcpSession *> expired;
+    uint64_t writeTimeout = (uint64_t)cfg.writeTimeoutMs * 1000000ULL;
+    for (std::unordered_map<int, TcpSession *>::iterator it = tcpSessions.begin(); it != tcpSessions.end(); ++it) {
+      uint64_t blocked = it->second->conn.blockedSince();
+      if (it->second->deadline < now) {
+        expired.push_back(it->second);
+      } else if (blocked != 0 && now - blocked > writeTimeout) {
+        // A client that stopped reading holds its output in our pool, reclaim it early.
+        expired.push_back(it->second);
+        tcpStats.slowReaders++;
+      }
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+      expired[i]->conn.cancel(); // The session runs to its end and frees itself.
+    }
+    for (std::unordered_map<UdpPeer, UdpSession, UdpPeerHash>::iterator it = udpSessions.begin(); it != udpSessions.end();) {
+      if (it->second.deadline < now) {
+        logSession(LOG_UDP, it->second.api, it->first.ip, it->second.task, LOG_ABANDONED, now - it->second.started);
+        admission.release(it->first.ip);
+        it = udpSessions.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    // An unanswered assignment expires, the channel stays for the next hello.
+    for (size_t i = 0; i < shmSessions.size(); i++) {
+      if (shmSessions[i]->active && shmSessions[i]->deadline < now) {
+        ShmSession *s = shmSessions[i];
+        logSession(LOG_SHM, s->api, SHM_CLIENT, s->task, LOG_ABANDONED, now - s->started);
+        s->active = false;
+      }
+    }
+  }
+
+  /* One record for an assignment that got its verdict or was given up on. */
+  void logSession(SessionTransport transport, ApiType api, const IpKey &ip, const Assignment &task,
+                  SessionOutcome outcome, uint64_t elapsedNs) {
+    if (!sessionLog.isOpen()) {
+      return;
+    }
+    SessionRecord r;
+    r.time = realtimeNs();
+    memcpy(r.client, &ip.hi, 8);
+    memcpy(r.client + 8, &ip.lo, 8);
+    r.id = task.id;
+    r.latencyUs = elapsedNs / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t)(elapsedNs / 1000);
+    r.value1 = task.value1;
+    r.value2 = task.value2;
+    r.result = task.result;
+    r.transport = transport;
+    r.api = api == API_BINARY ? LOG_BINARY : LOG_TEXT;
+    r.arith = task.arith;
+    r.outcome = outcome;
+    sessionLog.append(r);
+  }
+
+  void shutdownAll() {
+    sched.run(0, [this](const WorkItem &w) { dropWork(w); });
+    std::vector<TcpSession *> all;
+    for (std::unordered_map<int, TcpSession *>::iterator it = tcpSessions.begin(); it != tcpSessions.end(); ++it) {
+      all.push_back(it->second);
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+      all[i]->conn.cancel();
+    }
+    while (!shmSessions.empty()) {
+      closeShm(shmSessions.back());
+    }
+    closeShmListener();
+    close(listenFd);
+    close(udpFd);
+    close(epfd);
+  }
+
+  const ServerConfig &cfg;
+  int index;
+  int cpu;  // Pinned to, -1 = not pinned.
+  int node; // Memory preferred from, -1 = wherever the kernel likes.
+  int epfd;
+  int listenFd;
+  int udpFd;
+  int shmListenFd; // Worker 0 only.
+  bool udpWriteArmed;
+  bool shmSpinning; // Clients need not wake us, we poll their rings.
+  bool released; // Sockets are with the main thread for a hot restart.
+  std::atomic<bool> stopping; // stop() was called.
+  uint32_t nextId;
+  uint64_t nextSerial;
+  uint64_t lastSweep;
+  AdmissionControl admission;
+  FairScheduler<WorkItem> sched;
+  ClientLatency latency; // Session latency per client, for printStats().
+  SessionLog sessionLog;
+  std::vector<QueuedDatagram *> datagramPool; // Free buffers for onUdpReadable().
+  size_t datagramsAllocated;
+  std::unordered_map<int, TcpSession *> tcpSessions;
+  CoroOutbox outbox; // TCP output of this loop iteration.
+  struct {
+    uint64_t sessions;
+    uint64_t writes;
+    uint64_t resumed; // Chose with a resume ticket instead of the list.
+    uint64_t slowReaders; // Dropped by the write timeout.
+  } tcpStats;
+  CoroOutputStats output; // Of the worker thread, taken when it stops.
+  struct {
+    uint64_t local;
+    uint64_t remote; // Processed on another node than the worker's CPU.
+  } arrivals;
+  std::unordered_map<UdpPeer, UdpSession, UdpPeerHash> udpSessions;
+  std::deque<PendingDatagram> udpPending;
+  std::vector<ShmSession *> shmSessions;
+  std::vector<HandoffSession> handoffSessions;
+  std::vector<HandoffDatagram> handoffDatagrams;
+};
+
+/* Wait until <count> workers have released their sockets. False on a stop
+   request or after HANDOFF_TIMEOUT_MS, e.g. when a worker has already exited. */
+static bool awaitWorkersReleased(int count) {
+  uint64_t deadline = monotonicNs() + HANDOFF_TIMEOUT_MS * 1000000ULL;
+  while (workersReleased.load(std::memory_order_acquire) != count) {
+    if (stopRequested || monotonicNs() > deadline) {
+      return false;
+    }
+    struct timespec pause = {0, 1000000};
+    nanosleep(&pause, NULL);
+  }
+  return true;
+}
+
+/*
+   Old side of a hot restart, run by the main thread when a successor connects
+   to the handoff socket. Returns true if the successor took the sockets.
+*/
+static bool handOver(int listenSock, const ServerConfig &cfg, std::vector<Worker *> &workers) {
+  int sock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+  if (sock < 0) {
+    return false;
+  }
+  handoffSetTimeout(sock, HANDOFF_TIMEOUT_MS);
+  uint32_t request = 0;
+  if (!handoffReadAll(sock, &request, sizeof(request)) || request != HANDOFF_MAGIC) {
+    close(sock);
+    return false;
+  }
+
+  // Wait for every worker to stop using its sockets.
+  handoffResult.store(HANDOFF_PENDING, std::memory_order_release);
+  handoffRequested.store(true, std::memory_order_release);
+  bool released = awaitWorkersReleased(workers.size());
+
+  std::vector<int> fds;
+  std::vector<HandoffSession> sessions;
+  std::vector<HandoffDatagram> datagrams;
+  for (size_t i = 0; i < workers.size(); i++) {
+    fds.push_back(workers[i]->tcpListener());
+    fds.push_back(workers[i]->udpSocket());
+    sessions.insert(sessions.end(), workers[i]->releasedSessions().begin(), workers[i]->releasedSessions().end());
+    datagrams.insert(datagrams.end(), workers[i]->releasedDatagrams().begin(), workers[i]->releasedDatagrams().end());
+  }
+  HandoffHeader header;
+  header.magic = HANDOFF_MAGIC;
+  header.workers = workers.size();
+  header.sessions = sessions.size();
+  header.datagrams = datagrams.size();
+  header.ticketKey = ticketKey;
+
+  // The successor acknowledges with one byte once it owns everything.
+  char ack = 0;
+  bool ok = released && handoffSendFds(sock, fds.data(), fds.size(), &header, sizeof(header)) &&
+    (sessions.empty() || handoffWriteAll(sock, sessions.data(), sessions.size() * sizeof(HandoffSession))) &&
+    (datagrams.empty() || handoffWriteAll(sock, datagrams.data(), datagrams.size() * sizeof(HandoffDatagram))) &&
+    handoffReadAll(sock, &ack, 1) && ack == 1;
+  close(sock);
+
+  if (!ok) {
+    fprintf(stderr, "Handoff failed, continuing to serve.\n");
+    handoffResult.store(HANDOFF_FAILED, std::memory_order_release);
+    // A worker that is still released then reclaims once it sees no request.
+    awaitWorkersReleased(0);
+    handoffRequested.store(false, std::memory_order_release);
+    handoffResult.store(HANDOFF_PENDING, std::memory_order_release);
+    return false;
+  }
+  printf("Handed over %zu sockets, %zu UDP sessions and %zu datagrams, draining.\n",
+         fds.size(), sessions.size(), datagrams.size());
+  drainDeadline.store(monotonicNs() + (uint64_t)cfg.drainTimeoutMs * 1000000ULL, std::memory_order_release);
+  handoffResult.store(HANDOFF_DONE, std::memory_order_release);
+  return true;
+}
+
+/*
+   New side of a hot restart: take the sockets and UDP state of the server
+   listening on <path>. The worker count follows the old process, since every
+   inherited SO_REUSEPORT socket needs an owner or its share of the traffic
+   would be lost.
+*/
+static bool takeOver(const char *path, ServerConfig &cfg, std::vector<Worker *> &workers) {
+  int sock = handoffConnect(path);
+  if (sock < 0) {
+    return false;
+  }
+  handoffSetTimeout(sock, HANDOFF_TIMEOUT_MS);
+  uint32_t request = HANDOFF_MAGIC;
+  HandoffHeader header;
+  int fds[HANDOFF_MAX_FDS];
+  int count = -1;
+  if (handoffWriteAll(sock, &request, sizeof(request))) {
+    count = handoffRecvFds(sock, fds, HANDOFF_MAX_FDS, &header, sizeof(header));
+  }
+  if (count < 0 || header.magic != HANDOFF_MAGIC || count != (int)header.workers * 2) {
+    fprintf(stderr, "Takeover from %s failed.\n", path);
+    for (int i = 0; i < count; i++) {
+      close(fds[i]);
+    }
+    close(sock);
+    return false;
+  }
+  setTicketKey(header.ticketKey);
+  if (cfg.workers != (int)header.workers) {
+    printf("Using %u workers, as the previous server.\n", header.workers);
+    cfg.workers = header.workers;
+  }
+  for (uint32_t i = 0; i < header.workers; i++) {
+    Worker *w = new (workerNode(cfg, i)) Worker(cfg, i);
+    workers.push_back(w);
+    if (!w->adopt(fds[2 * i], fds[2 * i + 1])) {
+      // No acknowledgement, so the old server keeps serving.
+      fprintf(stderr, "Worker %u failed to take over.\n", i);
+      close(sock);
+      return false;
+    }
+  }
+
+  bool ok = true;
+  for (uint32_t i = 0; ok && i < header.sessions; i++) {
+    HandoffSession h;
+    ok = handoffReadAll(sock, &h, sizeof(h)) && h.worker < header.workers;
+    if (ok) {
+      workers[h.worker]->restoreSession(h);
+    }
+  }
+  for (uint32_t i = 0; ok && i < header.datagrams; i++) {
+    HandoffDatagram h;
+    ok = handoffReadAll(sock, &h, sizeof(h)) && h.worker < header.workers && h.len <= MAX_DATAGRAM;
+    if (ok) {
+      workers[h.worker]->restoreDatagram(h);
+    }
+  }
+  char ack = 1;
+  ok = ok && handoffWriteAll(sock, &ack, 1);
+  close(sock);
+  if (ok) {
+    printf("Took over %d sockets, %u UDP sessions and %u datagrams from %s.\n",
+           count, header.sessions, header.datagrams, path);
+  }
+  return ok;
+}
+
+/*
+   --self-bench: a fresh set of workers per batch size (--sched-budget) on
+   the configured address, driven by selfBenchRun() (selfbench.h) from this
+   thread. All load comes from one address, so admission limits are off.
+*/
+static int selfBench(const ServerConfig &base, SelfBenchConfig &bench, const char *path) {
+  ServerConfig cfg = base;
+  cfg.maxSessions = 0;
+  cfg.maxPerIp = 0;
+  cfg.rate = 0;
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char portStr[16];
+  snprintf(portStr, sizeof(portStr), "%d", cfg.port);
+  int rv = getaddrinfo(cfg.host, portStr, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return 1;
+  }
+  memcpy(&bench.addr, res->ai_addr, res->ai_addrlen);
+  bench.addrLen = res->ai_addrlen;
+  freeaddrinfo(res);
+  // A wildcard address is served on loopback too.
+  if (bench.addr.ss_family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&bench.addr;
+    if (sin->sin_addr.s_addr == htonl(INADDR_ANY)) {
+      sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+  } else if (bench.addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&bench.addr;
+    if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)) {
+      sin6->sin6_addr = in6addr_loopback;
+    }
+  }
+  bench.workers = cfg.workers;
+  bench.stop = &stopRequested;
+
+  std::vector<Worker *> workers;
+  std::vector<std::thread> threads;
+  std::function<void()> stop = [&]() {
+    for (size_t i = 0; i < workers.size(); i++) {
+      workers[i]->stop();
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+      delete workers[i];
+    }
+    workers.clear();
+    threads.clear();
+  };
+  std::function<bool(int)> start = [&](int batch) {
+    cfg.schedBudget = batch;
+    for (int i = 0; i < cfg.workers; i++) {
+      Worker *w = new (workerNode(cfg, i)) Worker(cfg, i);
+      workers.push_back(w);
+      if (!w->open()) {
+        fprintf(stderr, "Worker %d failed to start.\n", i);
+        stop();
+        return false;
+      }
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+      threads.push_back(std::thread(&Worker::run, workers[i]));
+    }
+    return true;
+  };
+  if (!selfBenchRun(bench, start, stop, path)) {
+    fprintf(stderr, "Self-bench failed, see above; what was measured is in %s.\n", path);
+    return 1;
+  }
+  printf("Self-bench report in %s.\n", path);
+  return 0;
+}
+
+/* Everything but the address, as without options. */
+static void defaultConfig(ServerConfig *cfg) {
+  cfg->workers = 1;
+  cfg->maxSessions = 1024;
+  cfg->maxPerIp = 64;
+  cfg->rate = 0;
+  cfg->burst = 0;
+  cfg->sendHighWater = 65536;
+  cfg->sendLowWater = 16384;
+  cfg->writeTimeoutMs = 1000;
+  cfg->outputPool = 16 << 20;
+  cfg->sessionTimeoutMs = 5000;
+  cfg->tracePath = NULL;
+  cfg->traceSample = 1;
+  cfg->handoffPath = NULL;
+  cfg->takeoverPath = NULL;
+  cfg->drainTimeoutMs = 30000;
+  cfg->busyPoll = false;
+  cfg->busyPollIdleUs = 1000;
+  cfg->pinCpu = -1;
+  cfg->shmName = NULL;
+  cfg->coalesce = true;
+  cfg->schedBudget = 64;
+  cfg->schedQuantum = 2;
+  cfg->sessionLogDir = NULL;
+  cfg->sessionLogRecords = SESSION_SEGMENT_RECORDS_DEFAULT;
+  cfg->numa = false;
+  cfg->numaStats = false;
+  cfg->nic = NULL;
+  cfg->topology = NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s <ip>:<port> [options]\n", prog);
+  fprintf(stderr, "  --workers N          worker threads (default 1)\n");
+  fprintf(stderr, "  --max-sessions N     concurrent sessions per worker, 0 = unlimited (default 1024)\n");
+  fprintf(stderr, "  --max-per-ip N       concurrent sessions per source IP per worker (default 64)\n");
+  fprintf(stderr, "  --rate R             new sessions per second per worker, 0 = unlimited (default 0)\n");
+  fprintf(stderr, "  --burst B            token bucket depth for --rate (default R)\n");
+  fprintf(stderr, "  --send-highwater B   pause reading a connection above B unsent bytes (default 65536)\n");
+  fprintf(stderr, "  --send-lowwater B    resume it at B unsent bytes (default 16384)\n");
+  fprintf(stderr, "  --write-timeout MS   drop a TCP client that took no output for MS (default 1000)\n");
+  fprintf(stderr, "  --output-pool B      TCP output memory per worker, 0 = unlimited (default 16777216)\n");
+  fprintf(stderr, "  --timeout MS         TCP session timeout (default 5000)\n");
+  fprintf(stderr, "  --trace FILE         record session phases, write Chrome trace JSON on SIGUSR1 and exit\n");
+  fprintf(stderr, "  --trace-sample N     trace one session in N (default 1)\n");
+  fprintf(stderr, "  --handoff PATH       hand the sockets to a successor that connects to unix socket PATH\n");
+  fprintf(stderr, "  --takeover PATH      start with the sockets of the server listening on PATH\n");
+  fprintf(stderr, "  --drain-timeout MS   after a handoff, serve open sessions this long (default 30000)\n");
+  fprintf(stderr, "  --busy-poll          spin on the UDP socket instead of sleeping in epoll\n");
+  fprintf(stderr, "  --busy-poll-idle US  stop spinning after US microseconds without a datagram (default 1000)\n");
+  fprintf(stderr, "  --pin-cpu N          pin worker i to CPU N+i (busy poll pins from CPU 0)\n");
+  fprintf(stderr, "  --shm NAME           accept shared-memory clients, SHM://NAME/text|binary\n");
+  fprintf(stderr, "  --no-coalesce        write every TCP message at once, Nagle on (for comparison)\n");
+  fprintf(stderr, "  --sched-budget N     work items per loop iteration, fair over clients, 0 = all ready (default 64)\n");
+  fprintf(stderr, "  --sched-quantum N    work items per client turn (default 2)\n");
+  fprintf(stderr, "  --session-log DIR    append a binary record per assignment to segments in DIR (see logtool)\n");
+  fprintf(stderr, "  --session-log-records N  records per segment (default %u)\n", SESSION_SEGMENT_RECORDS_DEFAULT);
+  fprintf(stderr, "  --numa               pin workers near the NIC, bind their memory, steer flows by CPU\n");
+  fprintf(stderr, "  --nic IFACE          interface for --numa (default the one holding <ip>)\n");
+  fprintf(stderr, "  --numa-stats         count arrivals processed on another node than their worker\n");
+  fprintf(stderr, "  --self-bench FILE    sweep load on loopback in-process, write a JSON capacity report, exit\n");
+  fprintf(stderr, "  --bench-p99 US       self-bench target p99 (default 1000)\n");
+  fprintf(stderr, "  --bench-step S       self-bench seconds per point (default 0.5)\n");
+  fprintf(stderr, "  --bench-inflight L   self-bench load concurrencies, comma separated (default 16,256)\n");
+  fprintf(stderr, "  --bench-batch L      self-bench --sched-budget values, comma separated (default 16,64)\n");
+}
+
+#ifdef FUZZ
+/*
+   libFuzzer entry point of fuzz-server (make fuzz), which has no main(). Every
+   input gets a fresh worker on socketpairs, see Worker::fuzzInput(); its
+   first byte picks where the datagrams are cut.
+*/
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static ServerConfig cfg;
+  if (cfg.workers == 0) {
+    defaultConfig(&cfg);
+    cfg.host = "127.0.0.1";
+    cfg.port = 5555;
+    setTicketKey(1);
+    coroSetOutputLimit((cfg.outputPool + CORO_CHUNK_SIZE - 1) / CORO_CHUNK_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+  }
+  if (size == 0) {
+    return 0;
+  }
+  int tcp[2];
+  int udp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, tcp) != 0 ||
+      socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, udp) != 0) {
+    abort();
+  }
+  // tcp[0] stands in for the listener; nothing connects, so it never fires.
+  Worker *w = new (workerNode(cfg, 0)) Worker(cfg, 0);
+  if (!w->adopt(tcp[0], udp[0])) {
+    abort();
+  }
+  w->fuzzInput((const char *)data + 1, size - 1, data[0] % size);
+  close(tcp[1]);
+  close(udp[1]);
+  delete w;
+  return 0;
+}
+
+// libFuzzer brings its own main().
+#define main serverMain
+#endif
+
 int main(int argc, char *argv[]){
-  
+
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
   /*
-    Read first input, assumes <ip>:<port> syntax, convert into one string (Desthost) and one integer (port). 
-     Atm, works only on dotted notation, i.e. IPv4 and DNS. IPv6 does not work if its using ':'. 
+    Read first input, assumes <ip>:<port> syntax, convert into one string (Desthost) and one integer (port).
+     Atm, works only on dotted notation, i.e. IPv4 and DNS. IPv6 does not work if its using ':'.
   */
   char delim[]=":";
   char *Desthost=strtok(argv[1],delim);
   char *Destport=strtok(NULL,delim);
   // *Desthost now points to a sting holding whatever came before the delimiter, ':'.
-  // *Dstport points to whatever string came after the delimiter. 
+  // *Dstport points to whatever string came after the delimiter.
+  if (Desthost == NULL || Destport == NULL) {
+    usage(argv[0]);
+    return 1;
+  }
 
   /* Do magic */
   int port=atoi(Destport);
-#ifdef DEBUG  
+#ifdef DEBUG
   printf("Host %s, and port %d.\n",Desthost,port);
 #endif
 
+  ServerConfig cfg;
+  defaultConfig(&cfg);
+  cfg.host = Desthost;
+  cfg.port = port;
+
+  const char *selfBenchPath = NULL;
+  SelfBenchConfig bench;
+  bench.targetP99Us = 1000;
+  bench.step = 0.5;
+  bench.startRate = 1000;
+  bench.growth = 2;
+  bench.maxRate = 4000000;
+  selfBenchParseList("16,256", &bench.inFlight);
+  selfBenchParseList("16,64", &bench.batches);
+
+  static struct option longOptions[] = {
+    {"workers", required_argument, 0, 'w'},
+    {"max-sessions", required_argument, 0, 'm'},
+    {"max-per-ip", required_argument, 0, 'i'},
+    {"rate", required_argument, 0, 'r'},
+    {"burst", required_argument, 0, 'b'},
+    {"send-highwater", required_argument, 0, 'h'},
+    {"send-lowwater", required_argument, 0, 'l'},
+    {"write-timeout", required_argument, 0, 'W'},
+    {"output-pool", required_argument, 0, 'o'},
+    {"timeout", required_argument, 0, 't'},
+    {"trace", required_argument, 0, 'T'},
+    {"trace-sample", required_argument, 0, 'S'},
+    {"handoff", required_argument, 0, 'H'},
+    {"takeover", required_argument, 0, 'O'},
+    {"drain-timeout", required_argument, 0, 'D'},
+    {"busy-poll", no_argument, 0, 'B'},
+    {"busy-poll-idle", required_argument, 0, 'I'},
+    {"pin-cpu", required_argument, 0, 'P'},
+    {"shm", required_argument, 0, 'M'},
+    {"no-coalesce", no_argument, 0, 'N'},
+    {"sched-budget", required_argument, 0, 'G'},
+    {"sched-quantum", required_argument, 0, 'Q'},
+    {"session-log", required_argument, 0, 'L'},
+    {"session-log-records", required_argument, 0, 'R'},
+    {"numa", no_argument, 0, 'U'},
+    {"nic", required_argument, 0, 'C'},
+    {"numa-stats", no_argument, 0, 'A'},
+    {"self-bench", required_argument, 0, 'X'},
+    {"bench-p99", required_argument, 0, 'Y'},
+    {"bench-step", required_argument, 0, 'Z'},
+    {"bench-inflight", required_argument, 0, 'K'},
+    {"bench-batch", required_argument, 0, 'J'},
+    {0, 0, 0, 0}
+  };
+  optind = 2;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'w': cfg.workers = atoi(optarg); break;
+      case 'm': cfg.maxSessions = atoi(optarg); break;
+      case 'i': cfg.maxPerIp = atoi(optarg); break;
+      case 'r': cfg.rate = atof(optarg); break;
+      case 'b': cfg.burst = atof(optarg); break;
+      case 'h': cfg.sendHighWater = strtoul(optarg, NULL, 10); break;
+      case 'l': cfg.sendLowWater = strtoul(optarg, NULL, 10); break;
+      case 'W': cfg.writeTimeoutMs = atoi(optarg); break;
+      case 'o': cfg.outputPool = strtoul(optarg, NULL, 10); break;
+      case 't': cfg.sessionTimeoutMs = atoi(optarg); break;
+      case 'T': cfg.tracePath = optarg; break;
+      case 'S': cfg.traceSample = strtoul(optarg, NULL, 10); break;
+      case 'H': cfg.handoffPath = optarg; break;
+      case 'O': cfg.takeoverPath = optarg; break;
+      case 'D': cfg.drainTimeoutMs = atoi(optarg); break;
+      case 'B': cfg.busyPoll = true; break;
+      case 'I': cfg.busyPollIdleUs = atoi(optarg); break;
+      case 'P': cfg.pinCpu = atoi(optarg); break;
+      case 'M': cfg.shmName = optarg; break;
+      case 'N': cfg.coalesce = false; break;
+      case 'G': cfg.schedBudget = strtoul(optarg, NULL, 10); break;
+      case 'Q': cfg.schedQuantum = atoi(optarg); break;
+      case 'L': cfg.sessionLogDir = optarg; break;
+      case 'R': cfg.sessionLogRecords = strtoul(optarg, NULL, 10); break;
+      case 'U': cfg.numa = true; break;
+      case 'C': cfg.nic = optarg; break;
+      case 'A': cfg.numaStats = true; break;
+      case 'X': selfBenchPath = optarg; break;
+      case 'Y': bench.targetP99Us = atof(optarg); break;
+      case 'Z': bench.step = atof(optarg); break;
+      case 'K':
+        if (!selfBenchParseList(optarg, &bench.inFlight)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'J':
+        if (!selfBenchParseList(optarg, &bench.batches)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (cfg.workers < 1) {
+    cfg.workers = 1;
+  }
+  if (cfg.sendLowWater > cfg.sendHighWater) {
+    cfg.sendLowWater = cfg.sendHighWater;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onStopSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = onDumpSignal;
+  sigaction(SIGUSR1, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  handoffStopOn(&stopRequested);
+
+  /* Initialize the library, this is needed for this library. */
+  initCalcLib();
+  if (cfg.tracePath != NULL) {
+    traceConfigure(cfg.traceSample, 1 << 16);
+  }
+
+  Topology topology;
+  char nicName[64];
+  if (cfg.numa || cfg.numaStats) {
+    if (cfg.nic == NULL) {
+      cfg.nic = topologyNicFor(cfg.host, nicName, sizeof(nicName));
+    }
+    if (!topologyDiscover(&topology, cfg.nic)) {
+      return 1;
+    }
+    cfg.topology = &topology;
+    char cpus[256];
+    topologyFormatCpus(topology.nicCpus, cpus, sizeof(cpus));
+    printf("Topology: %zu cpus on %d node(s), nic %s on node %d, its packets on cpus %s.\n", topology.cpus.size(),
+           topology.nodes, cfg.nic != NULL ? cfg.nic : "none", topology.nicNode, cpus);
+  }
+
+  if (selfBenchPath != NULL) {
+    // Load threads on the CPUs the workers leave, at least one.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bench.threads = cpus > cfg.workers ? (int)(cpus - cfg.workers) : 1;
+    setTicketKey(realtimeNs());
+    return selfBench(cfg, bench, selfBenchPath);
+  }
+
+  std::vector<Worker *> workers;
+  if (cfg.takeoverPath != NULL) {
+    if (!takeOver(cfg.takeoverPath, cfg, workers)) {
+      return 1;
+    }
+  } else {
+    uint64_t key;
+    if (getrandom(&key, sizeof(key), 0) != (ssize_t)sizeof(key)) {
+      key = realtimeNs() ^ ((uint64_t)getpid() << 32);
+    }
+    setTicketKey(key);
+    for (int i = 0; i < cfg.workers; i++) {
+      Worker *w = new (workerNode(cfg, i)) Worker(cfg, i);
+      if (!w->open()) {
+        fprintf(stderr, "Worker %d failed to start.\n", i);
+        return 1;
+      }
+      workers.push_back(w);
+    }
+  }
+  // Bind the handoff socket only now, a successor replaces the old one's path.
+  int handoffFd = -1;
+  if (cfg.handoffPath != NULL) {
+    handoffFd = handoffListen(cfg.handoffPath);
+    if (handoffFd < 0) {
+      return 1;
+    }
+  }
 
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers.size(); i++) {
+    threads.push_back(std::thread(&Worker::run, workers[i]));
+  }
+  // The main thread serves trace dumps and hot restarts while the workers run.
+  while (!stopRequested) {
+    struct pollfd pfd;
+    pfd.fd = handoffFd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, handoffFd >= 0 ? 1 : 0, 100) > 0 && handOver(handoffFd, cfg, workers)) {
+      break;
+    }
+    if (dumpRequested && cfg.tracePath != NULL) {
+      dumpRequested = 0;
+      traceDump(cfg.tracePath);
+    }
+  }
+  if (handoffFd >= 0) {
+    close(handoffFd);
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  if (cfg.tracePath != NULL && !traceDump(cfg.tracePath)) {
+    perror(cfg.tracePath);
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i]->printStats();
+    delete workers[i];
+  }
+  return 0;
 }
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sessionlog.h"
+
+/*
+   Implementation of sessionlog.h.
+
+   A segment is created at its full size with posix_fallocate(), so the disk
+   blocks exist before any record is stored and a full disk shows up as a
+   failed rotation, not as SIGBUS in the middle of a session. The mapping is
+   not prefaulted: a page fault every 85 records is cheaper than stalling the
+   worker while a whole segment is faulted in at rotation.
+*/
+
+#define SESSION_RETRY_EVERY 65536 // Dropped records between attempts to create a segment.
+
+SessionLog::SessionLog()
+  : written(0), dropped(0), segments(0), dir(NULL), worker(0), sequence(0), fd(-1), header(NULL),
+    records(NULL), used(0), capacity(0), mapped(0) {
+  path[0] = '\0';
+}
+
+SessionLog::~SessionLog() {
+  close();
+}
+
+bool SessionLog::open(const char *directory, int workerIndex, size_t recordsPerSegment) {
+  dir = directory;
+  worker = workerIndex;
+  capacity = recordsPerSegment > 0 ? recordsPerSegment : SESSION_SEGMENT_RECORDS_DEFAULT;
+  if (!create()) {
+    dir = NULL;
+    return false;
+  }
+  return true;
+}
+
+void SessionLog::close() {
+  if (header != NULL) {
+    seal();
+  }
+  dir = NULL;
+}
+
+bool SessionLog::rotate() {
+  if (dir == NULL) {
+    return false;
+  }
+  if (header != NULL) {
+    seal();
+  } else if (dropped % SESSION_RETRY_EVERY != 0) {
+    return false; // The last attempt failed, do not retry on every session.
+  }
+  return create();
+}
+
+bool SessionLog::create() {
+  sequence++;
+  snprintf(path, sizeof(path), "%s/%d-%d-%06llu.open", dir, (int)getpid(), worker, (unsigned long long)sequence);
+  fd = ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "session log %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  mapped = SESSION_SEGMENT_HEADER + capacity * sizeof(SessionRecord);
+  int rv = posix_fallocate(fd, 0, mapped);
+  void *p = MAP_FAILED;
+  if (rv == 0) {
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    rv = p == MAP_FAILED ? errno : 0;
+  }
+  if (rv != 0) {
+    fprintf(stderr, "session log %s: %s\n", path, strerror(rv));
+    ::close(fd);
+    unlink(path);
+    fd = -1;
+    return false;
+  }
+  header = (SessionSegmentHeader *)p;
+  records = (SessionRecord *)((char *)p + SESSION_SEGMENT_HEADER);
+  memset(header, 0, SESSION_SEGMENT_HEADER);
+  memcpy(header->magic, SESSION_LOG_MAGIC, sizeof(header->magic));
+  header->version = SESSION_LOG_VERSION;
+  header->recordSize = sizeof(SessionRecord);
+  header->worker = worker;
+  header->pid = getpid();
+  header->capacity = capacity;
+  used = 0;
+  return true;
+}
+
+void SessionLog::seal() {
+  header->count = used;
+  header->sealed = 1;
+  munmap(header, mapped);
+  header = NULL;
+  records = NULL;
+  if (ftruncate(fd, SESSION_SEGMENT_HEADER + used * sizeof(SessionRecord)) < 0) {
+    fprintf(stderr, "session log %s: %s\n", path, strerror(errno));
+  }
+  ::close(fd);
+  fd = -1;
+  if (used == 0) {
+    unlink(path);
+  } else {
+    char sealedPath[sizeof(path)];
+    snprintf(sealedPath, sizeof(sealedPath), "%.*s.seg", (int)(strlen(path) - 5), path);
+    if (rename(path, sealedPath) < 0) {
+      fprintf(stderr, "session log %s: %s\n", path, strerror(errno));
+    }
+    segments++;
+  }
+  used = 0;
+}
+
+bool sessionSegmentValid(const SessionSegmentHeader *h, size_t fileSize) {
+  return fileSize >= SESSION_SEGMENT_HEADER && memcmp(h->magic, SESSION_LOG_MAGIC, sizeof(h->magic)) == 0 &&
+         h->version == SESSION_LOG_VERSION && h->recordSize == sizeof(SessionRecord) && h->sealed &&
+         h->count <= (fileSize - SESSION_SEGMENT_HEADER) / sizeof(SessionRecord);
+}
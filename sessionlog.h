@@ -0,0 +1,122 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   Binary session log: one fixed-width record per assignment, for auditing and
+   offline analytics (logtool).
+
+   Every server worker appends to its own segment, a file of SESSION_SEGMENT_
+   HEADER bytes followed by SessionRecords, mapped with MAP_SHARED. Appending
+   is a struct copy into the mapping and a counter update: no locks, no
+   formatting and no system calls. Writing the pages out is the kernel's job.
+   When a segment is full it is sealed (the header gets its final count, the
+   file is cut to its used length and renamed from .open to .seg) and the next
+   one is created; those are the only system calls, once per segment. A
+   worker that exits seals what it has.
+
+     <dir>/<pid>-<worker>-<seq>.open   being written, count in the header is
+                                       only a hint
+     <dir>/<pid>-<worker>-<seq>.seg    sealed, never written again
+
+   Only sealed segments are meant to be read. Records are in host byte order;
+   the header says which record size and version wrote them.
+*/
+
+#define SESSION_LOG_MAGIC "CALCLOG1"
+#define SESSION_LOG_VERSION 1
+#define SESSION_SEGMENT_HEADER 64
+#define SESSION_SEGMENT_RECORDS_DEFAULT (1u << 20) // 48 MiB per segment.
+
+enum SessionTransport { LOG_TCP, LOG_UDP, LOG_SHM, LOG_TRANSPORTS };
+enum SessionApi { LOG_TEXT, LOG_BINARY, LOG_APIS };
+enum SessionOutcome {
+  LOG_CORRECT,   // Answered right.
+  LOG_WRONG,     // Answered wrong, or not an answer.
+  LOG_ABANDONED, // No answer: timed out, or the client went away.
+  LOG_OUTCOMES
+};
+
+struct SessionRecord {
+  uint64_t time;      // CLOCK_REALTIME nanoseconds at the verdict (or when given up).
+  uint8_t client[16]; // IPv6, IPv4 as v4-mapped.
+  uint32_t id;        // Assignment id.
+  uint32_t latencyUs; // Session start to verdict.
+  int32_t value1;
+  int32_t value2;
+  int32_t result;     // The right answer.
+  uint8_t transport;  // SessionTransport.
+  uint8_t api;        // SessionApi.
+  uint8_t arith;      // calcProtocol arith code.
+  uint8_t outcome;    // SessionOutcome.
+};
+
+static_assert(sizeof(SessionRecord) == 48, "the segment format depends on it");
+
+struct SessionSegmentHeader {
+  char magic[8];        // SESSION_LOG_MAGIC, no NUL.
+  uint32_t version;
+  uint32_t recordSize;  // sizeof(SessionRecord).
+  uint32_t worker;
+  uint32_t pid;
+  uint64_t count;       // Records in the segment, final once sealed.
+  uint64_t capacity;
+  uint64_t firstTime;   // SessionRecord::time of the first and last record.
+  uint64_t lastTime;
+  uint32_t sealed;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(SessionSegmentHeader) <= SESSION_SEGMENT_HEADER, "header too large");
+
+/* Segment writer of one worker. Not thread safe, like the worker. */
+class SessionLog {
+public:
+  SessionLog();
+  ~SessionLog();
+
+  /* Start writing segments of <records> records into <dir>. */
+  bool open(const char *dir, int worker, size_t records);
+  bool isOpen() const { return dir != NULL; }
+
+  void append(const SessionRecord &r) {
+    // No header after a failed rotation: rotate() retries now and then.
+    if ((header == NULL || used == capacity) && !rotate()) {
+      dropped++;
+      return;
+    }
+    if (used == 0) {
+      header->firstTime = r.time;
+    }
+    records[used++] = r;
+    header->count = used;
+    header->lastTime = r.time;
+    written++;
+  }
+
+  /* Seal the current segment and stop. */
+  void close();
+
+  uint64_t written;  // Records appended.
+  uint64_t dropped;  // Records lost because a segment could not be created.
+  uint64_t segments; // Segments sealed.
+
+private:
+  bool rotate();
+  bool create();
+  void seal();
+
+  const char *dir;
+  int worker;
+  uint64_t sequence;
+  int fd;
+  SessionSegmentHeader *header; // Start of the mapping.
+  SessionRecord *records;
+  size_t used;
+  size_t capacity;
+  size_t mapped;
+  char path[4096];
+};
+
+/* Check a segment header, e.g. in a reader. */
+bool sessionSegmentValid(const SessionSegmentHeader *h, size_t fileSize);
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <new>
+
+#include "shmtransport.h"
+#include "handoff.h"
+
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static void copyIn(ShmRing *r, uint32_t pos, const void *src, size_t len) {
+  uint32_t off = pos & (SHM_RING_SIZE - 1);
+  size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+  memcpy(r->data + off, src, first);
+  memcpy(r->data, (const char *)src + first, len - first);
+}
+
+static void copyOut(const ShmRing *r, uint32_t pos, void *dst, size_t len) {
+  uint32_t off = pos & (SHM_RING_SIZE - 1);
+  size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+  memcpy(dst, r->data + off, first);
+  memcpy((char *)dst + first, r->data, len - first);
+}
+
+bool shmSend(ShmEndpoint *ep, const void *data, size_t len) {
+  ShmRing *r = ep->out;
+  if (len > SHM_MAX_FRAME) {
+    return false;
+  }
+  uint32_t head = r->head.load(std::memory_order_relaxed);
+  uint32_t tail = r->tail.load(std::memory_order_acquire);
+  if (SHM_RING_SIZE - (head - tail) < len + 2) {
+    return false;
+  }
+  uint16_t frameLen = (uint16_t)len;
+  copyIn(r, head, &frameLen, 2);
+  copyIn(r, head + 2, data, len);
+  r->head.store(head + 2 + (uint32_t)len, std::memory_order_release);
+
+  // Pairs with the fence in shmRecv(): either the consumer sees the frame
+  // when it re-checks the ring, or we see it waiting and wake it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (r->waiting.load(std::memory_order_relaxed)) {
+    uint64_t one = 1;
+    if (write(ep->outEvent, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int shmTryRecv(ShmEndpoint *ep, void *buf, size_t cap) {
+  ShmRing *r = ep->in;
+  uint32_t tail = r->tail.load(std::memory_order_relaxed);
+  uint32_t head = r->head.load(std::memory_order_acquire);
+  uint32_t used = head - tail;
+  if (used == 0) {
+    return 0;
+  }
+  uint16_t frameLen;
+  if (used < 2 || used > SHM_RING_SIZE) {
+    return -1;
+  }
+  copyOut(r, tail, &frameLen, 2);
+  if (frameLen > SHM_MAX_FRAME || frameLen > cap || (uint32_t)frameLen + 2 > used) {
+    return -1;
+  }
+  copyOut(r, tail + 2, buf, frameLen);
+  r->tail.store(tail + 2 + frameLen, std::memory_order_release);
+  return frameLen;
+}
+
+static uint64_t monotonicUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int shmRecv(ShmEndpoint *ep, void *buf, size_t cap, int spinUs, int timeoutMs) {
+  uint64_t spinUntil = monotonicUs() + spinUs;
+  for (;;) {
+    int n = shmTryRecv(ep, buf, cap);
+    if (n != 0 || monotonicUs() >= spinUntil) {
+      if (n != 0) {
+        return n;
+      }
+      break;
+    }
+  }
+
+  uint64_t deadline = monotonicUs() + (uint64_t)timeoutMs * 1000ULL;
+  for (;;) {
+    shmSetWaiting(ep, true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int n = shmTryRecv(ep, buf, cap);
+    if (n != 0) {
+      shmSetWaiting(ep, false);
+      return n;
+    }
+    uint64_t now = monotonicUs();
+    if (now >= deadline) {
+      shmSetWaiting(ep, false);
+      return 0;
+    }
+    struct pollfd pfd;
+    pfd.fd = ep->inEvent;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+    shmDrainEvent(ep);
+  }
+}
+
+void shmSetWaiting(ShmEndpoint *ep, bool waiting) {
+  ep->in->waiting.store(waiting ? 1 : 0, std::memory_order_relaxed);
+}
+
+void shmDrainEvent(ShmEndpoint *ep) {
+  uint64_t count;
+  while (read(ep->inEvent, &count, sizeof(count)) > 0) {
+  }
+}
+
+static socklen_t abstractAddress(const char *name, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // Abstract namespace: leading NUL, no file to clean up.
+  int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "calc-shm-%s", name);
+  if (n < 0 || n >= (int)sizeof(addr->sun_path) - 1) {
+    return 0;
+  }
+  return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+int shmConnect(const char *name, ShmEndpoint *ep) {
+  struct sockaddr_un addr;
+  socklen_t addrLen = abstractAddress(name, &addr);
+  if (addrLen == 0) {
+    return -1;
+  }
+  int memFd = memfd_create("calc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  int toServer = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int toClient = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  void *mem = MAP_FAILED;
+  // Sealed at its final size, so the server can map it without fearing SIGBUS.
+  if (memFd >= 0 && ftruncate(memFd, sizeof(ShmChannel)) == 0 &&
+      fcntl(memFd, F_ADD_SEALS, SHM_SEALS) == 0) {
+    mem = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+  }
+  bool ok = mem != MAP_FAILED && toServer >= 0 && toClient >= 0 && sock >= 0;
+  if (ok) {
+    ShmChannel *ch = new (mem) ShmChannel();
+    ch->magic = SHM_MAGIC;
+    ch->size = sizeof(ShmChannel);
+    ch->toServer.head.store(0);
+    ch->toServer.tail.store(0);
+    ch->toServer.waiting.store(1); // The server sleeps in epoll unless told otherwise.
+    ch->toClient.head.store(0);
+    ch->toClient.tail.store(0);
+    ch->toClient.waiting.store(0);
+    ep->channel = ch;
+    ep->out = &ch->toServer;
+    ep->in = &ch->toClient;
+    ep->outEvent = toServer;
+    ep->inEvent = toClient;
+
+    int fds[3] = {memFd, toServer, toClient};
+    uint32_t magic = SHM_MAGIC;
+    char ack = 0;
+    ok = connect(sock, (struct sockaddr *)&addr, addrLen) == 0 &&
+      handoffSendFds(sock, fds, 3, &magic, sizeof(magic)) &&
+      handoffReadAll(sock, &ack, 1) && ack == 1;
+  }
+  if (memFd >= 0) {
+    close(memFd); // The mapping keeps the memory alive.
+  }
+  if (!ok) {
+    if (mem != MAP_FAILED) {
+      munmap(mem, sizeof(ShmChannel));
+    }
+    if (toServer >= 0) close(toServer);
+    if (toClient >= 0) close(toClient);
+    if (sock >= 0) close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int shmListen(const char *name) {
+  struct sockaddr_un addr;
+  socklen_t addrLen = abstractAddress(name, &addr);
+  if (addrLen == 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, addrLen) < 0 || listen(fd, SOMAXCONN) < 0) {
+    perror("shm listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int shmAccept(int listenFd, ShmEndpoint *ep) {
+  int sock = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+  if (sock < 0) {
+    return -1;
+  }
+  // Bounded wait, a client that connects and sends nothing must not stall us.
+  struct timeval tv = {0, 100000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  int fds[3];
+  uint32_t magic = 0;
+  int count = handoffRecvFds(sock, fds, 3, &magic, sizeof(magic));
+  if (count != 3 || magic != SHM_MAGIC) {
+    for (int i = 0; i < count; i++) {
+      close(fds[i]);
+    }
+    close(sock);
+    return -1;
+  }
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fcntl(fds[0], F_GET_SEALS) == SHM_SEALS && fstat(fds[0], &st) == 0 &&
+      st.st_size == (off_t)sizeof(ShmChannel)) {
+    mem = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  }
+  close(fds[0]);
+  ShmChannel *ch = (ShmChannel *)mem;
+  char ack = 1;
+  if (mem == MAP_FAILED || ch->magic != SHM_MAGIC || ch->size != sizeof(ShmChannel) ||
+      !handoffWriteAll(sock, &ack, 1)) {
+    if (mem != MAP_FAILED) {
+      munmap(mem, sizeof(ShmChannel));
+    }
+    close(fds[1]);
+    close(fds[2]);
+    close(sock);
+    return -1;
+  }
+  ep->channel = ch;
+  ep->out = &ch->toClient;
+  ep->in = &ch->toServer;
+  ep->outEvent = fds[2];
+  ep->inEvent = fds[1];
+  return sock;
+}
+
+void shmClose(ShmEndpoint *ep) {
+  if (ep->channel != NULL) {
+    munmap(ep->channel, sizeof(ShmChannel));
+    ep->channel = NULL;
+  }
+  close(ep->outEvent);
+  close(ep->inEvent);
+}
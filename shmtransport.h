@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/*
+   Shared-memory transport for clients on the same host as the server,
+   used for SHM://name/api URLs.
+
+   A client creates a memfd holding one ShmChannel (a pair of SPSC rings, one
+   per direction) and two eventfds, and passes all three to the server over the
+   abstract unix socket "calc-shm-<name>" with SCM_RIGHTS. The unix socket stays
+   open for the life of the channel, so either side sees the other one go away.
+
+   The rings carry the same frames as UDP: the text or calcMessage hello, the
+   assignment, the answer and the verdict, each as one length-prefixed frame.
+   A channel can run any number of sessions one after the other.
+
+   Wakeups: a consumer that is about to sleep sets <waiting> on its ring and
+   checks the ring again; a producer writes the peer's eventfd only if
+   <waiting> is set. Two spinning peers therefore exchange frames without any
+   system call.
+
+   The server must treat the shared memory as untrusted, shmTryRecv() checks
+   every index and length it reads from it.
+*/
+
+#define SHM_RING_SIZE 4096 // Bytes per direction, power of two.
+#define SHM_MAX_FRAME 1024
+#define SHM_MAGIC 0x53484d31 // "SHM1"
+
+struct ShmRing {
+  alignas(64) std::atomic<uint32_t> head;    // Bytes ever written, producer only.
+  alignas(64) std::atomic<uint32_t> tail;    // Bytes ever read, consumer only.
+  alignas(64) std::atomic<uint32_t> waiting; // Consumer sleeps on its eventfd.
+  alignas(64) unsigned char data[SHM_RING_SIZE];
+};
+
+struct ShmChannel {
+  uint32_t magic;
+  uint32_t size; // sizeof(ShmChannel) of the client that created it.
+  ShmRing toServer;
+  ShmRing toClient;
+};
+
+/* One side of a channel. */
+struct ShmEndpoint {
+  ShmChannel *channel;
+  ShmRing *out;
+  ShmRing *in;
+  int outEvent; // Written to wake the peer.
+  int inEvent;  // Readable when the peer woke us.
+};
+
+/* Push one frame; false if it is too large or the ring is full. */
+bool shmSend(ShmEndpoint *ep, const void *data, size_t len);
+
+/* Pop one frame: its length, 0 if the ring is empty, -1 if the ring is corrupt. */
+int shmTryRecv(ShmEndpoint *ep, void *buf, size_t cap);
+
+/* Spin for up to <spinUs> microseconds, then sleep on the eventfd until a frame
+   arrives or <timeoutMs> passes. Returns like shmTryRecv(), 0 on timeout. */
+int shmRecv(ShmEndpoint *ep, void *buf, size_t cap, int spinUs, int timeoutMs);
+
+/* Mark whether we sleep on our eventfd (true) or poll the ring (false). */
+void shmSetWaiting(ShmEndpoint *ep, bool waiting);
+
+/* Clear a wakeup on inEvent so it can be waited for again. */
+void shmDrainEvent(ShmEndpoint *ep);
+
+/* Client: create a channel and hand it to server <name>. Returns the unix
+   socket that keeps the channel alive, or -1. */
+int shmConnect(const char *name, ShmEndpoint *ep);
+
+/* Server: listen for channels from clients of <name>. */
+int shmListen(const char *name);
+
+/* Server: accept one channel. Returns the unix socket of the client, or -1. */
+int shmAccept(int listenFd, ShmEndpoint *ep);
+
+void shmClose(ShmEndpoint *ep);
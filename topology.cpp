@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <string>
+
+#include "topology.h"
+
+/*
+   Implementation of topology.h.
+
+   Sources: /sys/devices/system/node/node*\/cpulist for the nodes,
+   /sys/devices/system/cpu/cpu*\/topology/thread_siblings_list for the cores,
+   the MSI interrupts of the interface's device (or of its parent, for virtio)
+   with /proc/irq/N/effective_affinity_list, and
+   /sys/class/net/<nic>/queues/rx-*\/rps_cpus. An interrupt that may land on
+   every CPU says nothing about where packets are processed and is ignored.
+   Memory policy goes through the raw system calls, the constants are the
+   kernel's (linux/mempolicy.h).
+*/
+
+#define TOPOLOGY_MPOL_PREFERRED 1
+#define TOPOLOGY_MAX_NODES 1024
+
+static bool readLine(const std::string &path, char *buf, size_t len) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fgets(buf, len, f) != NULL;
+  fclose(f);
+  if (ok) {
+    buf[strcspn(buf, "\n")] = '\0';
+  }
+  return ok;
+}
+
+/* "0-3,8,10-11" */
+static std::vector<int> parseCpuList(const char *s) {
+  std::vector<int> out;
+  while (*s != '\0') {
+    char *end;
+    long lo = strtol(s, &end, 10);
+    if (end == s || lo < 0) {
+      break;
+    }
+    long hi = lo;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s || hi < lo) {
+        break;
+      }
+    }
+    for (long c = lo; c <= hi && c < 65536; c++) {
+      out.push_back((int)c);
+    }
+    s = *end == ',' ? end + 1 : end;
+    if (end == s) {
+      break;
+    }
+  }
+  return out;
+}
+
+/* "00000000,0000000f", the lowest CPUs in the last word. */
+static std::vector<int> parseCpuMask(const char *s) {
+  std::vector<int> out;
+  int bit = 0;
+  for (const char *p = s + strlen(s); p > s;) {
+    char c = *--p;
+    if (c == ',') {
+      continue;
+    }
+    int v = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : 0;
+    for (int i = 0; i < 4; i++, bit++) {
+      if (v & (1 << i)) {
+        out.push_back(bit);
+      }
+    }
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+static void addIrqCpus(const std::string &msiDir, const Topology &t, std::vector<int> *cpus) {
+  DIR *d = opendir(msiDir.c_str());
+  if (d == NULL) {
+    return;
+  }
+  struct dirent *e;
+  char buf[4096];
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] < '0' || e->d_name[0] > '9') {
+      continue;
+    }
+    std::string irq = std::string("/proc/irq/") + e->d_name;
+    if (!readLine(irq + "/effective_affinity_list", buf, sizeof(buf)) &&
+        !readLine(irq + "/smp_affinity_list", buf, sizeof(buf))) {
+      continue;
+    }
+    std::vector<int> affinity = parseCpuList(buf);
+    if (affinity.size() < t.cpus.size()) {
+      cpus->insert(cpus->end(), affinity.begin(), affinity.end());
+    }
+  }
+  closedir(d);
+}
+
+/* Where the packets of <nic> are processed, and the node of its device. */
+static bool readNic(Topology *t, const char *nic, int maxCpu) {
+  char buf[4096];
+  std::string dev = std::string("/sys/class/net/") + nic;
+  if (access(dev.c_str(), F_OK) < 0) {
+    fprintf(stderr, "topology: no interface %s\n", nic);
+    return false;
+  }
+  // RPS moves protocol processing off the interrupt CPUs; where it is set up it decides.
+  DIR *d = opendir((dev + "/queues").c_str());
+  if (d != NULL) {
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      if (strncmp(e->d_name, "rx-", 3) == 0 &&
+          readLine(dev + "/queues/" + e->d_name + "/rps_cpus", buf, sizeof(buf))) {
+        std::vector<int> rps = parseCpuMask(buf);
+        t->nicCpus.insert(t->nicCpus.end(), rps.begin(), rps.end());
+      }
+    }
+    closedir(d);
+  }
+  if (t->nicCpus.empty()) {
+    addIrqCpus(dev + "/device/msi_irqs", *t, &t->nicCpus);
+    addIrqCpus(dev + "/device/../msi_irqs", *t, &t->nicCpus);
+  }
+  std::sort(t->nicCpus.begin(), t->nicCpus.end());
+  t->nicCpus.erase(std::unique(t->nicCpus.begin(), t->nicCpus.end()), t->nicCpus.end());
+  std::vector<int> online;
+  for (size_t i = 0; i < t->nicCpus.size(); i++) {
+    if (t->nicCpus[i] <= maxCpu && t->nodeOf[t->nicCpus[i]] >= 0) {
+      online.push_back(t->nicCpus[i]);
+    }
+  }
+  t->nicCpus = online;
+
+  int node = -1;
+  if (readLine(dev + "/device/numa_node", buf, sizeof(buf)) ||
+      readLine(dev + "/device/../numa_node", buf, sizeof(buf))) {
+    node = atoi(buf);
+  }
+  if (node < 0 && !t->nicCpus.empty()) {
+    node = t->nodeOf[t->nicCpus[0]];
+  }
+  t->nicNode = node >= 0 && node < t->nodes ? node : 0;
+  return true;
+}
+
+bool topologyDiscover(Topology *t, const char *nic) {
+  char buf[4096];
+  t->cpus.clear();
+  t->nodeOf.clear();
+  t->coreOf.clear();
+  t->nicCpus.clear();
+  t->nodes = 1;
+  t->nicNode = 0;
+  if (readLine("/sys/devices/system/cpu/online", buf, sizeof(buf))) {
+    t->cpus = parseCpuList(buf);
+  }
+  if (t->cpus.empty()) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long c = 0; c < (n > 0 ? n : 1); c++) {
+      t->cpus.push_back((int)c);
+    }
+  }
+  int maxCpu = t->cpus.back();
+  t->nodeOf.assign(maxCpu + 1, -1);
+  t->coreOf.assign(maxCpu + 1, -1);
+  for (size_t i = 0; i < t->cpus.size(); i++) {
+    int c = t->cpus[i];
+    t->nodeOf[c] = 0;
+    t->coreOf[c] = c;
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/thread_siblings_list";
+    if (readLine(path, buf, sizeof(buf))) {
+      std::vector<int> siblings = parseCpuList(buf);
+      if (!siblings.empty()) {
+        t->coreOf[c] = siblings[0];
+      }
+    }
+  }
+
+  std::vector<int> nodes;
+  if (readLine("/sys/devices/system/node/online", buf, sizeof(buf))) {
+    nodes = parseCpuList(buf);
+  }
+  for (size_t i = 0; i < nodes.size() && nodes[i] < TOPOLOGY_MAX_NODES; i++) {
+    std::string path = "/sys/devices/system/node/node" + std::to_string(nodes[i]) + "/cpulist";
+    if (!readLine(path, buf, sizeof(buf))) {
+      continue;
+    }
+    std::vector<int> cpus = parseCpuList(buf);
+    for (size_t j = 0; j < cpus.size(); j++) {
+      if (cpus[j] <= maxCpu && t->nodeOf[cpus[j]] >= 0) {
+        t->nodeOf[cpus[j]] = nodes[i];
+      }
+    }
+    t->nodes = std::max(t->nodes, nodes[i] + 1);
+  }
+
+  if (nic != NULL && !readNic(t, nic, maxCpu)) {
+    return false;
+  }
+  t->distance.assign(t->nodes, 20);
+  t->distance[t->nicNode] = 10;
+  std::string path = "/sys/devices/system/node/node" + std::to_string(t->nicNode) + "/distance";
+  if (readLine(path, buf, sizeof(buf))) {
+    char *p = buf;
+    for (int n = 0; n < t->nodes; n++) {
+      char *end;
+      long d = strtol(p, &end, 10);
+      if (end == p) {
+        break;
+      }
+      t->distance[n] = (int)d;
+      p = end;
+    }
+  }
+  return true;
+}
+
+std::vector<int> topologyPlace(const Topology &t, int workers) {
+  // Rank every CPU: NIC CPUs, the NIC's node, the other nodes; first thread of a core before its siblings.
+  std::vector<std::pair<long, int> > ranked;
+  for (size_t i = 0; i < t.cpus.size(); i++) {
+    int c = t.cpus[i];
+    bool nicCpu = std::binary_search(t.nicCpus.begin(), t.nicCpus.end(), c);
+    long group = nicCpu ? 0 : t.distance[t.nodeOf[c]];
+    long rank = (group * 2 + (t.coreOf[c] == c ? 0 : 1)) * 65536 + c;
+    ranked.push_back(std::make_pair(rank, c));
+  }
+  std::sort(ranked.begin(), ranked.end());
+  std::vector<int> out;
+  for (int i = 0; i < workers; i++) {
+    out.push_back(ranked[i % ranked.size()].second);
+  }
+  return out;
+}
+
+/* The interface with the default IPv4 route. */
+static const char *defaultRouteNic(char *buf, size_t len) {
+  FILE *f = fopen("/proc/net/route", "r");
+  if (f == NULL) {
+    return NULL;
+  }
+  char line[512];
+  const char *found = NULL;
+  while (found == NULL && fgets(line, sizeof(line), f) != NULL) {
+    char name[IF_NAMESIZE + 1];
+    unsigned long dest;
+    if (sscanf(line, "%16s %lx", name, &dest) == 2 && dest == 0) {
+      snprintf(buf, len, "%s", name);
+      found = buf;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+const char *topologyNicFor(const char *host, char *buf, size_t len) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    return NULL;
+  }
+  struct sockaddr_storage want;
+  memcpy(&want, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  bool wildcard = want.ss_family == AF_INET
+    ? ((struct sockaddr_in *)&want)->sin_addr.s_addr == htonl(INADDR_ANY)
+    : IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *)&want)->sin6_addr);
+  if (wildcard) {
+    return defaultRouteNic(buf, len);
+  }
+  struct ifaddrs *ifs;
+  if (getifaddrs(&ifs) < 0) {
+    return NULL;
+  }
+  const char *found = NULL;
+  for (struct ifaddrs *i = ifs; i != NULL && found == NULL; i = i->ifa_next) {
+    if (i->ifa_addr == NULL || i->ifa_addr->sa_family != want.ss_family || (i->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+    bool same = want.ss_family == AF_INET
+      ? ((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr == ((struct sockaddr_in *)&want)->sin_addr.s_addr
+      : memcmp(&((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr, &((struct sockaddr_in6 *)&want)->sin6_addr, 16) == 0;
+    if (same) {
+      snprintf(buf, len, "%s", i->ifa_name);
+      found = buf;
+    }
+  }
+  freeifaddrs(ifs);
+  return found;
+}
+
+bool topologyPreferNode(int node) {
+  if (node < 0 || node >= TOPOLOGY_MAX_NODES) {
+    return false;
+  }
+  unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_set_mempolicy, TOPOLOGY_MPOL_PREFERRED, mask, (unsigned long)TOPOLOGY_MAX_NODES) == 0;
+}
+
+void *topologyAlloc(size_t size, int node) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  if (node >= 0 && node < TOPOLOGY_MAX_NODES) {
+    // Before the first touch, so the pages are allocated there.
+    unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, p, size, TOPOLOGY_MPOL_PREFERRED, mask, (unsigned long)TOPOLOGY_MAX_NODES, 0);
+  }
+  return p;
+}
+
+void topologyFree(void *p, size_t size) {
+  if (p != NULL) {
+    munmap(p, size);
+  }
+}
+
+void topologyFormatCpus(const std::vector<int> &cpus, char *buf, size_t len) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (size_t i = 0; i < cpus.size() && used < len;) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      j++;
+    }
+    int n = j > i ? snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", cpus[i], cpus[j])
+                  : snprintf(buf + used, len - used, "%s%d", used ? "," : "", cpus[i]);
+    used += n > 0 ? (size_t)n : 0;
+    i = j + 1;
+  }
+  if (cpus.empty()) {
+    snprintf(buf, len, "none");
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+/*
+   CPU and NUMA topology for placing the server's workers, read from /sys and
+   /proc, no libnuma.
+
+   Placement puts worker i on a CPU of its own, in this order of preference:
+   CPUs that process the NIC's packets (its queue interrupts, or its RPS
+   CPUs where RPS is set up), other CPUs on the NIC's node, then the other
+   nodes, nearest first. Within each group one CPU per physical core comes
+   before the SMT siblings. A worker pinned where its packets are processed
+   also sets SO_INCOMING_CPU on its SO_REUSEPORT sockets, so the kernel
+   hands it the flows of that CPU and the packets never cross a node.
+
+   A machine without /sys/devices/system/node, or with one node, is one node
+   holding every online CPU; without a NIC (or for loopback) the NIC's node is
+   node 0. Memory binding is a preference, never a requirement: where the
+   kernel refuses it (no NUMA, seccomp) memory comes from wherever the kernel
+   puts it, as before.
+*/
+
+struct Topology {
+  std::vector<int> cpus;      // Online CPUs, ascending.
+  std::vector<int> nodeOf;    // By CPU number, -1 if offline.
+  std::vector<int> coreOf;    // By CPU number, the first CPU of its physical core.
+  int nodes;                  // Highest node number + 1.
+  std::vector<int> nicCpus;   // CPUs that process the NIC's packets, ascending.
+  int nicNode;
+  std::vector<int> distance;  // By node, from the NIC's node (SLIT, 10 = local).
+};
+
+/* Read the topology; <nic> (may be NULL) is the interface the workers serve. */
+bool topologyDiscover(Topology *t, const char *nic);
+
+/* One CPU per worker, see above. Workers share CPUs only when there are more
+   workers than online CPUs. */
+std::vector<int> topologyPlace(const Topology &t, int workers);
+
+/* The interface that holds <host>, NULL for a wildcard, loopback or unknown
+   address. Returns a pointer into <buf>. */
+const char *topologyNicFor(const char *host, char *buf, size_t len);
+
+/* Prefer memory of <node> for the calling thread's future allocations. */
+bool topologyPreferNode(int node);
+
+/* Fresh pages of <node> (any node if it is -1), NULL on failure. */
+void *topologyAlloc(size_t size, int node);
+void topologyFree(void *p, size_t size);
+
+/* "0-3,8" for a log line. */
+void topologyFormatCpus(const std::vector<int> &cpus, char *buf, size_t len);
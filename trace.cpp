@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+/*
+   Implementation of trace.h.
+
+   Rings are registered in a global list under a mutex the first time a thread
+   records a span, and are never freed, so a dump can still read the spans of
+   threads that have exited. Each slot carries a sequence number that the
+   writer stores last; the dumper skips slots whose sequence changed while it
+   was copying them, so a dump racing with writers only loses the spans that
+   were being overwritten.
+*/
+
+struct TraceEvent {
+  std::atomic<uint64_t> seq; // Ring position + 1 of the span in this slot, 0 = empty.
+  uint64_t start;
+  uint64_t end;
+  uint32_t id;
+  uint32_t phase;
+};
+
+struct TraceRing {
+  TraceEvent *events;
+  size_t mask;
+  std::atomic<uint64_t> head;
+  int tid;
+};
+
+static const char *phaseNames[TRACE_PHASE_COUNT] = {
+  "protocol-list", "choice", "assignment", "answer", "verify", "result"
+};
+
+static std::atomic<bool> enabled(false);
+static unsigned sampleEvery = 1;
+static size_t ringSize = 65536;
+static std::atomic<uint32_t> nextTraceId(1);
+
+static std::mutex ringsLock;
+static std::vector<TraceRing *> rings;
+
+// Clock calibration, taken in traceConfigure().
+static uint64_t baseTicks;
+static double ticksPerNs = 1.0;
+
+static thread_local TraceRing *localRing = NULL;
+static thread_local unsigned sampleCounter = 0;
+
+static uint64_t monotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void traceConfigure(unsigned every, size_t size) {
+  sampleEvery = every > 0 ? every : 1;
+  // Round the ring size up to a power of two so the position is a mask away.
+  ringSize = 1;
+  while (ringSize < size) {
+    ringSize <<= 1;
+  }
+
+  uint64_t ns0 = monotonicNs();
+  uint64_t t0 = traceNow();
+  struct timespec pause = {0, 10000000};
+  nanosleep(&pause, NULL);
+  uint64_t ns1 = monotonicNs();
+  uint64_t t1 = traceNow();
+  ticksPerNs = (double)(t1 - t0) / (double)(ns1 - ns0);
+  baseTicks = t0;
+
+  enabled.store(true, std::memory_order_release);
+}
+
+bool traceEnabled(void) {
+  return enabled.load(std::memory_order_relaxed);
+}
+
+uint32_t traceBegin(void) {
+  if (!enabled.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  if (++sampleCounter < sampleEvery) {
+    return 0;
+  }
+  sampleCounter = 0;
+  uint32_t id = nextTraceId.fetch_add(1, std::memory_order_relaxed);
+  return id != 0 ? id : nextTraceId.fetch_add(1, std::memory_order_relaxed);
+}
+
+static TraceRing *registerRing(void) {
+  TraceRing *r = new TraceRing();
+  r->events = new TraceEvent[ringSize];
+  for (size_t i = 0; i < ringSize; i++) {
+    r->events[i].seq.store(0, std::memory_order_relaxed);
+  }
+  r->mask = ringSize - 1;
+  r->head.store(0, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> guard(ringsLock);
+  r->tid = (int)rings.size() + 1;
+  rings.push_back(r);
+  return r;
+}
+
+void traceRecord(uint32_t id, TracePhase phase, uint64_t start, uint64_t end) {
+  TraceRing *r = localRing;
+  if (r == NULL) {
+    r = localRing = registerRing();
+  }
+  uint64_t pos = r->head.load(std::memory_order_relaxed);
+  TraceEvent &e = r->events[pos & r->mask];
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.start = start;
+  e.end = end;
+  e.id = id;
+  e.phase = phase;
+  e.seq.store(pos + 1, std::memory_order_release);
+  r->head.store(pos + 1, std::memory_order_release);
+}
+
+static double ticksToUs(uint64_t ticks) {
+  return (double)(int64_t)(ticks - baseTicks) / ticksPerNs / 1000.0;
+}
+
+bool traceDump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  std::vector<TraceRing *> snapshot;
+  {
+    std::lock_guard<std::mutex> guard(ringsLock);
+    snapshot = rings;
+  }
+
+  int pid = (int)getpid();
+  bool first = true;
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (size_t i = 0; i < snapshot.size(); i++) {
+    TraceRing *r = snapshot[i];
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            first ? "" : ",", pid, r->tid, r->tid);
+    first = false;
+
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    uint64_t from = head > r->mask + 1 ? head - (r->mask + 1) : 0;
+    for (uint64_t pos = from; pos < head; pos++) {
+      TraceEvent &e = r->events[pos & r->mask];
+      if (e.seq.load(std::memory_order_acquire) != pos + 1) {
+        continue;
+      }
+      uint64_t start = e.start;
+      uint64_t end = e.end;
+      uint32_t id = e.id;
+      uint32_t phase = e.phase;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (e.seq.load(std::memory_order_relaxed) != pos + 1 || phase >= TRACE_PHASE_COUNT) {
+        continue; // Overwritten while we copied it.
+      }
+      double ts = ticksToUs(start);
+      double dur = end > start ? (double)(end - start) / ticksPerNs / 1000.0 : 0.0;
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"session\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"session\":%u}}",
+              phaseNames[phase], ts, dur, pid, r->tid, id);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
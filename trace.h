@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+   Lightweight tracing of session phases, shared by client and server.
+
+   Every thread that records spans gets its own ring buffer the first time it
+   records one; writing a span is a few stores and one release store, no locks
+   and no system calls. Old spans are overwritten when a ring wraps. traceDump()
+   can be called from any thread at any time and writes the spans that are in
+   the rings as Chrome trace / Perfetto JSON (load it in ui.perfetto.dev or
+   chrome://tracing).
+
+   Timestamps are TSC ticks on x86-64 (converted to time at dump) and
+   CLOCK_MONOTONIC nanoseconds elsewhere.
+
+   Tracing is off until traceConfigure() is called. Only one session in
+   <sampleEvery> per thread is traced; traceBegin() returns 0 for the others
+   and all trace calls with id 0 return immediately.
+*/
+
+enum TracePhase {
+  TRACE_PROTOCOL_LIST, // TCP protocol list from the server.
+  TRACE_CHOICE,        // "TEXT TCP 1.1 OK", or the UDP hello (text or calcMessage).
+  TRACE_ASSIGNMENT,    // Text assignment or calcProtocol from the server.
+  TRACE_ANSWER,        // Answer from the client.
+  TRACE_VERIFY,        // Server checks the answer, client computes it.
+  TRACE_RESULT,        // OK/ERROR or calcMessage verdict.
+  TRACE_PHASE_COUNT
+};
+
+void traceConfigure(unsigned sampleEvery, size_t ringSize);
+bool traceEnabled(void);
+
+/* Start a new session; returns its trace id, or 0 if it is not sampled. */
+uint32_t traceBegin(void);
+
+void traceRecord(uint32_t id, TracePhase phase, uint64_t start, uint64_t end);
+
+static inline uint64_t traceNow(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void traceSpan(uint32_t id, TracePhase phase, uint64_t start, uint64_t end) {
+  if (id != 0) {
+    traceRecord(id, phase, start, end);
+  }
+}
+
+/* Write all recorded spans to <path>. Returns false if the file could not be written. */
+bool traceDump(const char *path);